@@ -34,7 +34,12 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define MEASURE_DIST  (MAX_DIST)
 #define MEASURE_ANGLE (ANGLE_PI / 4)
 
-int num_disqualified;
+/* Smallest number of samples worth handing to another thread */
+#define AVERAGE_RANGE_MIN 2
+
+/* Number of samples of each character that are averaged, the ones with the
+   best rough preprocessor measures. Zero averages every qualified sample. */
+int average_finalists = 0;
 
 float measure_distance(const Stroke *a, int i, const Stroke *b, int j,
                        const Vec2 *offset)
@@ -47,46 +52,167 @@ float measure_distance(const Stroke *a, int i, const Stroke *b, int j,
         return vec2_square(&v);
 }
 
+/* Table kernels are always inlined so that the specialized measures get
+   their measure function and elasticity as constants */
+#ifdef __GNUC__
+#define MEASURE_INLINE static inline __attribute__((always_inline))
+#else
+#define MEASURE_INLINE static inline
+#endif
+
+/* Dynamic programming rows hold a buffer entry on either side of up to
+   POINTS_MAX points */
+#define TABLE_WIDTH (POINTS_MAX + 2)
+
+/* Larger than any sum of angle differences on an integer table */
+#define ANGLE_TABLE_MAX (G_MAXINT / 4)
+
+static inline int angle_diff(ANGLE a, ANGLE b)
+/* Lesser difference between two angles */
+{
+        int diff;
+
+        diff = (ANGLE)(a - b);
+        return diff >= 0 ? diff : -diff;
+}
+
 static float measure_angle(const Stroke *a, int i, const Stroke *b, int j)
 /* Measure the lesser angular difference between two segments */
 {
-        float diff;
+        return angle_diff(a->points[i].angle, b->points[j].angle);
+}
+
+/* Lower bounds and partial sums are only trusted when they clear the limit
+   by this much because of rounding */
+#define BOUND_MARGIN 1.0001f
+
+static float measure_diagonal(const Stroke *a, const Stroke *b,
+                              const Vec2 *offset, int points, float limit,
+                              int *cells)
+/* Distance measure with no elasticity, where the only path through the
+   table is its diagonal. The distances are summed in the same order as the
+   table would so the result is identical. */
+{
+        float sum = 0.f, cutoff = MEASURE_ABANDONED;
+        int i;
 
-        diff = (ANGLE)(a->points[i].angle - b->points[j].angle);
-        return diff >= 0 ? diff : -diff;
+        if (limit < MEASURE_ABANDONED)
+                cutoff = limit * (points * 2) * BOUND_MARGIN;
+        for (i = 0; i < points; i++) {
+                float x, y;
+
+                x = a->points[i].x + offset->x - b->points[i].x;
+                y = a->points[i].y + offset->y - b->points[i].y;
+                if (!i)
+                        sum = 2 * (x * x + y * y);
+                else
+                        sum += (x * x + y * y) * 2;
+
+                /* The sum only grows */
+                if (sum >= cutoff) {
+                        *cells = i + 1;
+                        return MEASURE_ABANDONED;
+                }
+        }
+        *cells = points;
+        return sum / (points * 2);
 }
 
-float measure_strokes(Stroke *a, Stroke *b, MeasureFunc func,
-                      void *extra, int points, int elasticity)
+static float envelope_bound(const Stroke *a, const Stroke *b,
+                            const Vec2 *offset, int points, int elasticity)
+/* Lower bound on the distance measure from the bounding boxes of the points
+   of B that each point of A can be matched with. Every row and every column
+   of the table adds the measure of at least one cell in its band to any
+   path, so the bound is counted both ways. */
+{
+        double bound = 0.;
+        int i, j, k;
+
+        for (k = 0; k < 2; k++) {
+                const Stroke *s1 = k ? b : a, *s2 = k ? a : b;
+                float ox = k ? -offset->x : offset->x,
+                      oy = k ? -offset->y : offset->y;
+
+                for (i = 0; i < points; i++) {
+                        float x, y, dx = 0.f, dy = 0.f;
+                        int min_x, max_x, min_y, max_y, j_to;
+
+                        j = i - elasticity;
+                        if (j < 0)
+                                j = 0;
+                        j_to = i + elasticity + 1;
+                        if (j_to > points)
+                                j_to = points;
+                        min_x = max_x = s2->points[j].x;
+                        min_y = max_y = s2->points[j].y;
+                        for (j++; j < j_to; j++) {
+                                if (s2->points[j].x < min_x)
+                                        min_x = s2->points[j].x;
+                                if (s2->points[j].x > max_x)
+                                        max_x = s2->points[j].x;
+                                if (s2->points[j].y < min_y)
+                                        min_y = s2->points[j].y;
+                                if (s2->points[j].y > max_y)
+                                        max_y = s2->points[j].y;
+                        }
+                        x = s1->points[i].x + ox;
+                        y = s1->points[i].y + oy;
+                        if (x < min_x)
+                                dx = min_x - x;
+                        else if (x > max_x)
+                                dx = x - max_x;
+                        if (y < min_y)
+                                dy = min_y - y;
+                        else if (y > max_y)
+                                dy = y - max_y;
+                        bound += dx * dx + dy * dy;
+                }
+        }
+        return bound / (points * 2);
+}
+
+MEASURE_INLINE float measure_table(Stroke *a, Stroke *b, MeasureFunc func,
+                                  void *extra, int points, int elasticity,
+                                  float limit, int *cells)
 /* Find optimal match between A points and B points for lowest distance via
-   dynamic programming */
+   dynamic programming. Each row only depends on the one above it, so only
+   two rows of the table are kept. */
 {
+        float rows[2][TABLE_WIDTH], *row, *up;
         int i, j, j_to;
-        float table[(points + 1) * (points + 1) + 1];
 
         /* Coordinates are counted from 1 because of buffer areas */
+        if (points > POINTS_MAX)
+                points = POINTS_MAX;
         points++;
 
         /* Fill out the buffer row */
         j_to = elasticity + 2;
         if (points < j_to)
                 j_to = points;
+        up = rows[0];
         for (j = 1; j < j_to; j++)
-                table[j] = G_MAXFLOAT;
+                up[j] = G_MAXFLOAT;
 
         /* The first table entry is given */
-        table[points + 1] = 2 * func(a, 0, b, 0, extra);
+        row = rows[1];
+        row[1] = 2 * func(a, 0, b, 0, extra);
+        *cells = 1;
 
         for (i = 1; i < points; i++) {
-                float value;
+                float value, row_min = G_MAXFLOAT;
 
                 /* Starting position */
                 j = i - elasticity;
                 if (j < 1)
                         j = 1;
 
+                /* Rows alternate, the first row is the given entry's */
+                row = rows[i & 1];
+                up = rows[(i - 1) & 1];
+
                 /* Buffer column entry */
-                table[i * points + j - 1] = G_MAXFLOAT;
+                row[j - 1] = G_MAXFLOAT;
 
                 /* Start from the 2nd cell on the first row */
                 j += i == 1;
@@ -97,9 +223,10 @@ float measure_strokes(Stroke *a, Stroke *b, MeasureFunc func,
                         j_to = points;
 
                 /* Start with up-left */
-                value = table[(i - 1) * points + j - 1];
+                value = up[j - 1];
 
                 /* Dynamically program the row segment */
+                *cells += j_to - j;
                 for (; j < j_to; j++) {
                         float low_value, measure;
 
@@ -107,38 +234,626 @@ float measure_strokes(Stroke *a, Stroke *b, MeasureFunc func,
                         low_value = value + measure * 2;
 
                         /* Check if left is lower */
-                        value = table[i * points + j - 1] + measure;
+                        value = row[j - 1] + measure;
                         if (value <= low_value)
                                 low_value = value;
 
                         /* Check if up is lower */
-                        value = table[(i - 1) * points + j];
+                        value = up[j];
                         if (value + measure <= low_value)
                                 low_value = value + measure;
 
-                        table[i * points + j] = low_value;
+                        row[j] = low_value;
+                        if (low_value < row_min)
+                                row_min = low_value;
                 }
 
                 /* End of the row buffer */
-                table[i * points + j_to] = G_MAXFLOAT;
+                row[j_to] = G_MAXFLOAT;
+
+                /* Every path passes through this row and only grows after
+                   it, the first row also has the given entry */
+                if (i == 1 && row[1] < row_min)
+                        row_min = row[1];
+                if (row_min / ((points - 1) * 2) >= limit)
+                        return MEASURE_ABANDONED;
         }
 
         /* Return final lowest progression */
-        return table[points * points - 1] / ((points - 1) * 2);
+        return row[points - 1] / ((points - 1) * 2);
+}
+
+#if ANGLE_SIZE < 4
+MEASURE_INLINE float measure_angles(const Stroke *a, const Stroke *b,
+                                   int points, int elasticity, int *cells)
+/* Angle measure on an integer table. Angle differences are whole numbers
+   and no path through the table can add up to more than 2^24, so the float
+   table holds them exactly and the result is identical. */
+{
+        int rows[2][TABLE_WIDTH], *row, *up, i, j, j_to;
+
+        /* Coordinates are counted from 1 because of buffer areas */
+        if (points > POINTS_MAX)
+                points = POINTS_MAX;
+        points++;
+
+        /* Fill out the buffer row */
+        j_to = elasticity + 2;
+        if (points < j_to)
+                j_to = points;
+        up = rows[0];
+        for (j = 1; j < j_to; j++)
+                up[j] = ANGLE_TABLE_MAX;
+
+        /* The first table entry is given */
+        row = rows[1];
+        row[1] = 2 * angle_diff(a->points[0].angle,
+                                           b->points[0].angle);
+        *cells = 1;
+
+        for (i = 1; i < points; i++) {
+                int value;
+
+                /* Starting position */
+                j = i - elasticity;
+                if (j < 1)
+                        j = 1;
+
+                /* Rows alternate, the first row is the given entry's */
+                row = rows[i & 1];
+                up = rows[(i - 1) & 1];
+
+                /* Buffer column entry */
+                row[j - 1] = ANGLE_TABLE_MAX;
+
+                /* Start from the 2nd cell on the first row */
+                j += i == 1;
+
+                /* End limit */
+                j_to = i + elasticity + 1;
+                if (j_to > points)
+                        j_to = points;
+
+                /* Start with up-left */
+                value = up[j - 1];
+
+                /* Dynamically program the row segment */
+                *cells += j_to - j;
+                for (; j < j_to; j++) {
+                        int low_value, measure;
+
+                        measure = angle_diff(a->points[i - 1].angle,
+                                             b->points[j - 1].angle);
+                        low_value = value + measure * 2;
+
+                        /* Check if left is lower */
+                        value = row[j - 1] + measure;
+                        if (value <= low_value)
+                                low_value = value;
+
+                        /* Check if up is lower */
+                        value = up[j];
+                        if (value + measure <= low_value)
+                                low_value = value + measure;
+
+                        row[j] = low_value;
+                }
+
+                /* End of the row buffer */
+                row[j_to] = ANGLE_TABLE_MAX;
+        }
+
+        /* Return final lowest progression */
+        return (float)row[points - 1] / ((points - 1) * 2);
+}
+
+MEASURE_INLINE void measure_both(const Stroke *a, const Stroke *b,
+                                 const Vec2 *offset, int points,
+                                 int elasticity, float limit, int dist_live,
+                                 float *pdist, float *pangle, int *pcells)
+/* Fill out the distance and the angle tables together in one pass over the
+   band. The angle table is one point smaller so it skips the last row and
+   column. Each table is updated exactly as on its own so the results are
+   identical. If the distance measure is not live or is abandoned, the angle
+   table is finished alone. */
+{
+        float rows[2][TABLE_WIDTH], *row, *up;
+        int arows[2][TABLE_WIDTH], *arow, *aup, i, j, j_to, a_to,
+            cells, a_cells;
+
+        /* Coordinates are counted from 1 because of buffer areas */
+        if (points > POINTS_MAX)
+                points = POINTS_MAX;
+        points++;
+
+        /* Fill out the buffer rows */
+        up = rows[0];
+        aup = arows[0];
+        j_to = elasticity + 2;
+        if (points < j_to)
+                j_to = points;
+        for (j = 1; j < j_to; j++) {
+                up[j] = G_MAXFLOAT;
+                aup[j] = ANGLE_TABLE_MAX;
+        }
+
+        /* The first table entries are given */
+        row = rows[1];
+        arow = arows[1];
+        if (dist_live) {
+                float x, y;
+
+                x = a->points[0].x + offset->x - b->points[0].x;
+                y = a->points[0].y + offset->y - b->points[0].y;
+                row[1] = 2 * (x * x + y * y);
+        }
+        arow[1] = 2 * angle_diff(a->points[0].angle, b->points[0].angle);
+        cells = dist_live;
+        a_cells = 1;
+
+        for (i = 1; i < points; i++) {
+                float value = 0.f, row_min = G_MAXFLOAT;
+                int a_value = 0;
+
+                /* Starting position */
+                j = i - elasticity;
+                if (j < 1)
+                        j = 1;
+
+                /* Rows alternate, the first row is the given entry's */
+                row = rows[i & 1];
+                up = rows[(i - 1) & 1];
+
+                /* Buffer column entries, the angle table has no last row */
+                row[j - 1] = G_MAXFLOAT;
+                a_to = j;
+                if (i < points - 1) {
+                        arow = arows[i & 1];
+                        aup = arows[(i - 1) & 1];
+                        arow[j - 1] = ANGLE_TABLE_MAX;
+                }
+
+                /* Start from the 2nd cell on the first row */
+                j += i == 1;
+
+                /* End limits */
+                j_to = i + elasticity + 1;
+                if (j_to > points)
+                        j_to = points;
+                if (i < points - 1)
+                        a_to = j_to < points - 1 ? j_to : points - 1;
+
+                /* Start with up-left */
+                if (dist_live)
+                        value = up[j - 1];
+                if (j < a_to)
+                        a_value = aup[j - 1];
+
+                /* Dynamically program the row segments */
+                if (dist_live)
+                        cells += j_to - j;
+                if (j < a_to)
+                        a_cells += a_to - j;
+                for (; j < j_to; j++) {
+                        if (dist_live) {
+                                float x, y, low_value, measure;
+
+                                x = a->points[i - 1].x + offset->x -
+                                    b->points[j - 1].x;
+                                y = a->points[i - 1].y + offset->y -
+                                    b->points[j - 1].y;
+                                measure = x * x + y * y;
+                                low_value = value + measure * 2;
+
+                                /* Check if left is lower */
+                                value = row[j - 1] + measure;
+                                if (value <= low_value)
+                                        low_value = value;
+
+                                /* Check if up is lower */
+                                value = up[j];
+                                if (value + measure <= low_value)
+                                        low_value = value + measure;
+
+                                row[j] = low_value;
+                                if (low_value < row_min)
+                                        row_min = low_value;
+                        }
+                        if (j < a_to) {
+                                int low_value, measure;
+
+                                measure = angle_diff(a->points[i - 1].angle,
+                                                     b->points[j - 1].angle);
+                                low_value = a_value + measure * 2;
+
+                                /* Check if left is lower */
+                                a_value = arow[j - 1] + measure;
+                                if (a_value <= low_value)
+                                        low_value = a_value;
+
+                                /* Check if up is lower */
+                                a_value = aup[j];
+                                if (a_value + measure <= low_value)
+                                        low_value = a_value + measure;
+
+                                arow[j] = low_value;
+                        }
+                }
+
+                /* End of the row buffers */
+                row[j_to] = G_MAXFLOAT;
+                if (i < points - 1)
+                        arow[a_to] = ANGLE_TABLE_MAX;
+
+                /* Every path passes through this row and only grows after
+                   it, the first row also has the given entry */
+                if (!dist_live)
+                        continue;
+                if (i == 1 && row[1] < row_min)
+                        row_min = row[1];
+                if (row_min / ((points - 1) * 2) >= limit)
+                        dist_live = FALSE;
+        }
+
+        /* Return final lowest progressions */
+        *pdist = dist_live ? row[points - 1] / ((points - 1) * 2) :
+                             MEASURE_ABANDONED;
+        *pangle = (float)arow[points - 2] / ((points - 2) * 2);
+        *pcells += cells + a_cells;
+}
+
+static void measure_fused(const Stroke *a, const Stroke *b,
+                          const Vec2 *offset, int points, float limit,
+                          float *pdist, float *pangle)
+/* Take the distance and the angle measures together in one pass over the
+   band. If the distance measure is abandoned, the angle table is finished
+   alone. */
+{
+        Counters *counters;
+        int dists, cells = 0;
+
+        dists = limit >= MEASURE_ABANDONED ||
+                envelope_bound(a, b, offset, points, FINE_ELASTICITY) <
+                limit * BOUND_MARGIN;
+        measure_both(a, b, offset, points, FINE_ELASTICITY, limit, dists,
+                     pdist, pangle, &cells);
+        if ((counters = counters_current())) {
+                counters->ops[COUNTER_MEASURES] += 2;
+                counters->ops[COUNTER_CELLS] += cells;
+        }
+}
+
+/* Number of stroke pairs of equal length that are measured together, one in
+   each lane of the lane tables */
+#define AVERAGE_LANES 8
+
+/* Stroke pairs of one length are only measured in lanes when there are at
+   least this many of them, all of the lanes are filled out however many are
+   used */
+#define AVERAGE_LANES_MIN 4
+
+/* Points and tables of the stroke pairs measured in lanes. The lane is the
+   last index of every array so that a cell is updated for all of the lanes
+   with one pass over contiguous values. */
+typedef struct {
+        float a_x[POINTS_MAX][AVERAGE_LANES], a_y[POINTS_MAX][AVERAGE_LANES],
+              b_x[POINTS_MAX][AVERAGE_LANES], b_y[POINTS_MAX][AVERAGE_LANES],
+              rows[2][TABLE_WIDTH][AVERAGE_LANES];
+        int a_angle[POINTS_MAX][AVERAGE_LANES],
+            b_angle[POINTS_MAX][AVERAGE_LANES],
+            a_rows[2][TABLE_WIDTH][AVERAGE_LANES];
+} MeasureLanes;
+
+/* Lane tables of each thread. They are allocated the first time the thread
+   measures in lanes and kept until it exits. */
+static GStaticPrivate lanes_key = G_STATIC_PRIVATE_INIT;
+
+static MeasureLanes *lanes_get(void)
+{
+        MeasureLanes *lanes;
+
+        if ((lanes = g_static_private_get(&lanes_key)))
+                return lanes;
+        lanes = g_malloc(sizeof (*lanes));
+        g_static_private_set(&lanes_key, lanes, g_free);
+        return lanes;
+}
+
+static void lanes_clear(MeasureLanes *lanes, int l, int points)
+/* Zero the points of unused lane L so that it is filled out on defined
+   values */
+{
+        int i;
+
+        for (i = 0; i < points; i++) {
+                lanes->a_x[i][l] = lanes->a_y[i][l] = 0.f;
+                lanes->b_x[i][l] = lanes->b_y[i][l] = 0.f;
+                lanes->a_angle[i][l] = lanes->b_angle[i][l] = 0;
+        }
+}
+
+static void lanes_set(MeasureLanes *lanes, int l, const Stroke *a,
+                      const Stroke *b, const Vec2 *offset, int points)
+/* Put the points of A and B into lane L. The offset is added to the A
+   points here, which rounds them the same way the measure would. */
+{
+        int i;
+
+        for (i = 0; i < points; i++) {
+                lanes->a_x[i][l] = a->points[i].x + offset->x;
+                lanes->a_y[i][l] = a->points[i].y + offset->y;
+                lanes->b_x[i][l] = b->points[i].x;
+                lanes->b_y[i][l] = b->points[i].y;
+                lanes->a_angle[i][l] = a->points[i].angle;
+                lanes->b_angle[i][l] = b->points[i].angle;
+        }
+}
+
+MEASURE_INLINE void lanes_dists(MeasureLanes *lanes, int i, int j_from,
+                                int j_to, int r, int u, float *row_min)
+/* Fill out a distance table row R of every lane from the row U above it.
+   The rows are constants wherever this is inlined, so the lane loops can be
+   vectorized without checking if the rows overlap. */
+{
+        int j, l;
+
+        for (j = j_from + (i == 1); j < j_to; j++)
+                for (l = 0; l < AVERAGE_LANES; l++) {
+                        float x, y, value, low_value, measure;
+
+                        x = lanes->a_x[i - 1][l] - lanes->b_x[j - 1][l];
+                        y = lanes->a_y[i - 1][l] - lanes->b_y[j - 1][l];
+                        measure = x * x + y * y;
+                        low_value = lanes->rows[u][j - 1][l] + measure * 2;
+
+                        /* Check if left is lower */
+                        value = lanes->rows[r][j - 1][l] + measure;
+                        low_value = value <= low_value ? value : low_value;
+
+                        /* Check if up is lower */
+                        value = lanes->rows[u][j][l] + measure;
+                        low_value = value <= low_value ? value : low_value;
+
+                        lanes->rows[r][j][l] = low_value;
+                        row_min[l] = low_value < row_min[l] ? low_value :
+                                                              row_min[l];
+                }
 }
 
-static void stroke_average(Stroke *a, Stroke *b, float *pdist, float *pangle,
-                           Vec2 *ac_to_bc)
-/* Compute the average measures for A vs B */
+MEASURE_INLINE void lanes_angles(MeasureLanes *lanes, int i, int j_from,
+                                 int j_to, int r, int u)
+/* Fill out an angle table row R of every lane from the row U above it */
+{
+        int j, l;
+
+        for (j = j_from + (i == 1); j < j_to; j++)
+                for (l = 0; l < AVERAGE_LANES; l++) {
+                        int value, low_value, measure;
+
+                        measure = angle_diff(lanes->a_angle[i - 1][l],
+                                             lanes->b_angle[j - 1][l]);
+                        low_value = lanes->a_rows[u][j - 1][l] + measure * 2;
+
+                        /* Check if left is lower */
+                        value = lanes->a_rows[r][j - 1][l] + measure;
+                        low_value = value <= low_value ? value : low_value;
+
+                        /* Check if up is lower */
+                        value = lanes->a_rows[u][j][l] + measure;
+                        low_value = value <= low_value ? value : low_value;
+
+                        lanes->a_rows[r][j][l] = low_value;
+                }
+}
+
+static void measure_lanes(MeasureLanes *lanes, int n, int points,
+                          const float *limits, int *live, float *dists,
+                          float *angles)
+/* Take the distance and the angle measures of the stroke pairs in the first
+   N lanes, which all have POINTS points, at the fine elasticity. Each cell
+   of the tables is updated for every lane at once. Lanes do not depend on
+   each other, so every cell has the same value it has on a table of its own
+   and the rows are checked for abandoning in the same order, the results
+   are identical to the fused measure. Lanes that are not LIVE have had
+   their distance measure abandoned before the tables. */
+{
+        float row_min[AVERAGE_LANES];
+        Counters *counters;
+        int i, j, l, j_from, j_to, a_points, a_cells, dists_live,
+            cells[AVERAGE_LANES];
+
+        if (points > POINTS_MAX)
+                points = POINTS_MAX;
+        a_points = points - 1;
+
+        /* Fill out the buffer rows */
+        for (j = 1; j < FINE_ELASTICITY + 2 && j <= points; j++)
+                for (l = 0; l < AVERAGE_LANES; l++) {
+                        lanes->rows[0][j][l] = G_MAXFLOAT;
+                        lanes->a_rows[0][j][l] = ANGLE_TABLE_MAX;
+                }
+
+        /* The first table entries are given */
+        for (l = 0, dists_live = 0; l < AVERAGE_LANES; l++) {
+                float x, y;
+
+                x = lanes->a_x[0][l] - lanes->b_x[0][l];
+                y = lanes->a_y[0][l] - lanes->b_y[0][l];
+                lanes->rows[1][1][l] = 2 * (x * x + y * y);
+                lanes->a_rows[1][1][l] = 2 * angle_diff(lanes->a_angle[0][l],
+                                                        lanes->b_angle[0][l]);
+                cells[l] = 0;
+                dists_live += live[l] = l < n && live[l];
+        }
+
+        for (i = 1, a_cells = 0; i <= points; i++) {
+                int r = i & 1;
+
+                /* Starting position */
+                j_from = i - FINE_ELASTICITY;
+                if (j_from < 1)
+                        j_from = 1;
+
+                /* Distance table row, unless every lane has abandoned it */
+                j_to = i + FINE_ELASTICITY + 1;
+                if (j_to > points + 1)
+                        j_to = points + 1;
+                for (l = 0; dists_live && l < AVERAGE_LANES; l++) {
+                        lanes->rows[r][j_from - 1][l] = G_MAXFLOAT;
+                        lanes->rows[r][j_to][l] = G_MAXFLOAT;
+                        row_min[l] = G_MAXFLOAT;
+                }
+                if (dists_live && r)
+                        lanes_dists(lanes, i, j_from, j_to, 1, 0, row_min);
+                else if (dists_live)
+                        lanes_dists(lanes, i, j_from, j_to, 0, 1, row_min);
+
+                /* Every path passes through this row and only grows after
+                   it, the first row also has the given entry */
+                for (l = 0; dists_live && l < AVERAGE_LANES; l++) {
+                        if (!live[l])
+                                continue;
+                        cells[l] += j_to - j_from;
+                        if (i == 1 && lanes->rows[1][1][l] < row_min[l])
+                                row_min[l] = lanes->rows[1][1][l];
+                        if (row_min[l] / (points * 2) >= limits[l]) {
+                                live[l] = FALSE;
+                                dists_live--;
+                        }
+                }
+
+                /* The angle table is one point smaller */
+                if (i > a_points)
+                        continue;
+                j_to = i + FINE_ELASTICITY + 1;
+                if (j_to > a_points + 1)
+                        j_to = a_points + 1;
+                a_cells += j_to - j_from;
+                for (l = 0; l < AVERAGE_LANES; l++) {
+                        lanes->a_rows[r][j_from - 1][l] = ANGLE_TABLE_MAX;
+                        lanes->a_rows[r][j_to][l] = ANGLE_TABLE_MAX;
+                }
+                if (r)
+                        lanes_angles(lanes, i, j_from, j_to, 1, 0);
+                else
+                        lanes_angles(lanes, i, j_from, j_to, 0, 1);
+        }
+
+        /* Return final lowest progressions */
+        counters = counters_current();
+        for (l = 0; l < n; l++) {
+                dists[l] = live[l] ? lanes->rows[points & 1][points][l] /
+                                     (points * 2) : MEASURE_ABANDONED;
+                angles[l] = (float)lanes->a_rows[a_points & 1][a_points][l] /
+                            (a_points * 2);
+                if (counters) {
+                        counters->ops[COUNTER_MEASURES] += 2;
+                        counters->ops[COUNTER_CELLS] += cells[l] + a_cells;
+                }
+        }
+}
+
+static float measure_angles_fine(const Stroke *a, const Stroke *b,
+                                 int points, int *cells)
+/* Angle table with the fine elasticity as a constant band width */
+{
+        return measure_angles(a, b, points, FINE_ELASTICITY, cells);
+}
+#endif
+
+static float measure_table_fine(Stroke *a, Stroke *b, Vec2 *offset,
+                                int points, float limit, int *cells)
+/* Distance table with the distance measure inlined and the fine elasticity
+   as a constant band width */
+{
+        return measure_table(a, b, (MeasureFunc)measure_distance, offset,
+                             points, FINE_ELASTICITY, limit, cells);
+}
+
+float measure_strokes(Stroke *a, Stroke *b, MeasureFunc func,
+                      void *extra, int points, int elasticity, float limit)
+/* Measure the lowest distance between A points and B points. If the
+   measure would be at least limit, the measurement may be abandoned early
+   and MEASURE_ABANDONED returned instead. Measures with the elasticities
+   in use are dispatched to specialized tables. */
+{
+        Counters *counters;
+        float value;
+        int cells = 0;
+
+        if (func == (MeasureFunc)measure_distance && !elasticity)
+                value = measure_diagonal(a, b, extra, points, limit, &cells);
+        else if (func == (MeasureFunc)measure_distance &&
+                 limit < MEASURE_ABANDONED &&
+                 envelope_bound(a, b, extra, points, elasticity) >=
+                 limit * BOUND_MARGIN)
+                value = MEASURE_ABANDONED;
+        else if (func == (MeasureFunc)measure_distance &&
+                 elasticity == FINE_ELASTICITY)
+                value = measure_table_fine(a, b, extra, points, limit, &cells);
+#if ANGLE_SIZE < 4
+        else if (func == (MeasureFunc)measure_angle &&
+                 elasticity == FINE_ELASTICITY)
+                value = measure_angles_fine(a, b, points, &cells);
+        else if (func == (MeasureFunc)measure_angle)
+                value = measure_angles(a, b, points, elasticity, &cells);
+#endif
+        else
+                value = measure_table(a, b, func, extra, points, elasticity,
+                                      limit, &cells);
+        if ((counters = counters_current())) {
+                counters->ops[COUNTER_MEASURES]++;
+                counters->ops[COUNTER_CELLS] += cells;
+        }
+        return value;
+}
+
+static Stroke *fine_stroke(Stroke *stroke, Stroke *fine, int points,
+                           Stroke *scratch)
+/* Use the cached fine stroke if it has the right number of points,
+   otherwise sample the stroke into the scratch buffer */
+{
+        if (fine && fine->len == points)
+                return fine;
+        return sample_stroke(scratch, stroke, points, points);
+}
+
+#if ANGLE_SIZE < 4
+static int measure_fusable(const Stroke *a, const Stroke *b, int points)
+/* Take both averages in one pass when both are wanted */
+{
+        return engines[ENGINE_AVGDIST].range &&
+               engines[ENGINE_AVGANGLE].range && a->spread >= DOT_SPREAD &&
+               b->spread >= DOT_SPREAD && points > 2 && FINE_ELASTICITY;
+}
+#endif
+
+static void stroke_average(Stroke *a, Stroke *a_fine, Stroke *b,
+                           Stroke *b_fine, Stroke **scratch, float *pdist,
+                           float *pangle, Vec2 *ac_to_bc, float dist_limit)
+/* Compute the average measures for A vs B. The fine strokes are cached
+   versions of A and B sampled at their own length and may be NULL. The
+   distance measure may be abandoned if it is at least dist_limit. */
 {
         Stroke *a_sampled, *b_sampled;
+        int points;
 
         /* Sample strokes to equal lengths */
         if (a->len < 1 || b->len < 1) {
                 g_warning("Attempted to measure zero-length stroke");
                 return;
         }
-        sample_strokes(a, b, &a_sampled, &b_sampled);
+        points = fine_points(a->distance >= b->distance ? a : b);
+        a_sampled = fine_stroke(a, a_fine, points, scratch[0]);
+        b_sampled = fine_stroke(b, b_fine, points, scratch[1]);
+
+#if ANGLE_SIZE < 4
+        if (measure_fusable(a, b, a_sampled->len)) {
+                measure_fused(a_sampled, b_sampled, ac_to_bc, a_sampled->len,
+                              dist_limit, pdist, pangle);
+                return;
+        }
+#endif
 
         /* Average the distance between the corresponding points */
         *pdist = 0.f;
@@ -146,85 +861,130 @@ static void stroke_average(Stroke *a, Stroke *b, float *pdist, float *pangle,
                 *pdist = measure_strokes(a_sampled, b_sampled,
                                          (MeasureFunc)measure_distance,
                                          ac_to_bc, a_sampled->len,
-                                         FINE_ELASTICITY);
+                                         FINE_ELASTICITY, dist_limit);
 
         /* We cannot run angle averages if one of the two strokes has no
            segments */
         *pangle = 0.f;
         if (a->spread < DOT_SPREAD)
-                goto cleanup;
+                return;
         else if (b->spread < DOT_SPREAD) {
                 *pangle = ANGLE_PI;
-                goto cleanup;
+                return;
         }
 
         /* Average the angle differences between the points */
         if (engines[ENGINE_AVGANGLE].range)
                 *pangle = measure_strokes(a_sampled, b_sampled,
                                           (MeasureFunc)measure_angle, NULL,
-                                          a_sampled->len - 1, FINE_ELASTICITY);
-
-cleanup:
-        /* Free stroke data */
-        stroke_free(a_sampled);
-        stroke_free(b_sampled);
+                                          a_sampled->len - 1, FINE_ELASTICITY,
+                                          MEASURE_ABANDONED);
 }
 
-static void sample_average(Sample *sample)
+/* Samples averaged together. Their strokes are measured in order, so that
+   the stroke pairs of equal length among them can be measured in lanes. */
+#define AVERAGE_BATCH 64
+
+/* State of the averages of the input of a context against a sample */
+typedef struct {
+        RecognizerContext *ctx;
+        Sample *sample, *smaller;
+        Stroke *input_stroke, *sample_stroke, *input_fine,
+               *sample_fine_stroke;
+        Vec2 ic_to_sc;
+        float distance, m_dist, m_angle, m_dist_max, weight, limit;
+        int k, slot;
+} AverageItem;
+
+static void average_start(AverageItem *item, RecognizerContext *ctx, int k,
+                          int slot)
 /* Take the distance between the input and the sample, enumerating the best
    match assignment between input and sample strokes
    TODO scale the measures by stroke distance */
 {
-        Vec2 ic_to_sc;
-        Sample *smaller;
-        float distance, m_dist, m_angle;
+        Sample *sample, *smaller, *input = ctx->input;
+        float distance;
         int i;
 
-        /* Ignore disqualified samples */
-        if ((i = sample_disqualified(sample))) {
-                if (i == 2)
-                        num_disqualified++;
-                return;
-        }
+        item->ctx = ctx;
+        item->k = k;
+        item->slot = slot;
+        item->sample = sample = sample_at(slot);
 
         /* Adjust for the difference between sample centers */
-        center_samples(&ic_to_sc, input, sample);
-
-        /* Run the averages */
-        smaller = input->len < sample->len ? input : sample;
-        for (i = 0, distance = 0.f, m_dist = 0.f, m_angle = 0.f;
-             i < smaller->len; i++) {
-                Stroke *input_stroke, *sample_stroke;
-                float weight, s_dist = MAX_DIST, s_angle = ANGLE_PI;
-
-                /* Transform strokes, mapping the larger sample onto the
-                   smaller one */
-                if (input->len >= sample->len) {
-                        input_stroke = transform_stroke(input,
-                                                        &sample->transform, i);
-                        sample_stroke = sample->strokes[i];
-                } else {
-                        input_stroke = input->strokes[i];
-                        sample_stroke = transform_stroke(sample,
-                                                         &sample->transform, i);
-                }
+        center_samples(&item->ic_to_sc, input, sample);
+
+        /* Once the summed distance passes this the rating is at its
+           lowest whatever the remaining strokes measure */
+        item->smaller = smaller = input->len < sample->len ? input : sample;
+        for (i = 0, distance = 0.f; i < smaller->len; i++)
+                distance += smaller->strokes[i]->spread < DOT_SPREAD ?
+                            DOT_SPREAD : smaller->strokes[i]->distance;
+        item->m_dist_max = MAX_DIST * distance * MAX_DIST * distance *
+                           BOUND_MARGIN;
+        item->distance = item->m_dist = item->m_angle = 0.f;
+}
+
+static void average_transform(AverageItem *item, int i)
+/* Transform the I-th strokes, mapping the larger sample onto the smaller
+   one. Untransformed strokes have cached fine versions. */
+{
+        Sample *input = item->ctx->input, *sample = item->sample;
+        Transform *tfm = item->ctx->transforms + item->slot;
 
-                weight = smaller->strokes[i]->spread < DOT_SPREAD ?
-                         DOT_SPREAD : smaller->strokes[i]->distance;
-                stroke_average(input_stroke, sample_stroke,
-                               &s_dist, &s_angle, &ic_to_sc);
-                m_dist += s_dist * weight;
-                m_angle += s_angle * weight;
-                distance += weight;
-
-                /* Clear the created stroke */
-                stroke_free(input->len >= sample->len ?
-                            input_stroke : sample_stroke);
+        item->input_fine = item->sample_fine_stroke = NULL;
+        if (input->len >= sample->len) {
+                item->input_stroke = transform_stroke(input, tfm, i);
+                item->sample_stroke = sample->strokes[i];
+                item->sample_fine_stroke = sample_fine(sample, i);
+        } else {
+                item->input_stroke = input->strokes[i];
+                item->input_fine = sample_fine(input, i);
+                item->sample_stroke = transform_stroke(sample, tfm, i);
         }
+        item->weight = item->smaller->strokes[i]->spread < DOT_SPREAD ?
+                       DOT_SPREAD : item->smaller->strokes[i]->distance;
+        item->limit = item->m_dist < item->m_dist_max ?
+                      (item->m_dist_max - item->m_dist) / item->weight : 0.f;
+}
+
+static void average_clear(AverageItem *item)
+/* Clear the created stroke */
+{
+        Sample *input = item->ctx->input;
+
+        stroke_free(input->len >= item->sample->len ? item->input_stroke :
+                                                      item->sample_stroke);
+}
+
+static void average_add(AverageItem *item, float s_dist, float s_angle)
+/* Add the measures of the transformed strokes */
+{
+        item->m_dist += s_dist * item->weight;
+        item->m_angle += s_angle * item->weight;
+        item->distance += item->weight;
+        average_clear(item);
+}
+
+static void average_stroke(AverageItem *item, Stroke **scratch)
+/* Measure the transformed strokes on their own */
+{
+        float s_dist = MAX_DIST, s_angle = ANGLE_PI;
+
+        stroke_average(item->input_stroke, item->input_fine,
+                       item->sample_stroke, item->sample_fine_stroke, scratch,
+                       &s_dist, &s_angle, &item->ic_to_sc, item->limit);
+        average_add(item, s_dist, s_angle);
+}
+
+static void average_finish(AverageItem *item)
+/* Assign the ratings from the summed measures */
+{
+        float m_dist, m_angle;
 
         /* Undo square distortion and account for multiple strokes */
-        m_dist = sqrtf(m_dist) / distance;
-        m_angle /= distance;
+        m_dist = sqrtf(item->m_dist) / item->distance;
+        m_angle = item->m_angle / item->distance;
 
         /* Check limits */
         if (m_dist > MAX_DIST)
@@ -233,35 +993,285 @@ static void sample_average(Sample *sample)
                 m_angle = ANGLE_PI;
 
         /* Assign the ratings */
-        sample->ratings[ENGINE_AVGDIST] = RATING_MAX -
-                                          RATING_MAX * m_dist / MEASURE_DIST;
-        sample->ratings[ENGINE_AVGANGLE] = RATING_MAX -
-                                           RATING_MAX * m_angle / MEASURE_ANGLE;
+        item->ctx->ratings[item->slot][ENGINE_AVGDIST] = RATING_MAX -
+                                                         RATING_MAX * m_dist /
+                                                         MEASURE_DIST;
+        item->ctx->ratings[item->slot][ENGINE_AVGANGLE] = RATING_MAX -
+                                                          RATING_MAX *
+                                                          m_angle /
+                                                          MEASURE_ANGLE;
+}
+
+#if ANGLE_SIZE < 4
+static int average_lanes_points(AverageItem *item)
+/* Number of points the transformed strokes are measured at if they can be
+   measured in lanes, otherwise zero */
+{
+        Stroke *a = item->input_stroke, *b = item->sample_stroke;
+        int points;
+
+        if (a->len < 1 || b->len < 1)
+                return 0;
+        points = fine_points(a->distance >= b->distance ? a : b);
+        return measure_fusable(a, b, points) ? points : 0;
+}
+
+static int lanes_compare(const void *a, const void *b)
+/* Order stroke pairs by number of points and then by context */
+{
+        const int *ia = a, *ib = b;
+
+        if (ia[0] != ib[0])
+                return ia[0] - ib[0];
+        return ia[1] != ib[1] ? ia[1] - ib[1] : ia[2] - ib[2];
+}
+
+static void average_lanes(AverageItem *items, const int *pairs, int n,
+                          Stroke **scratch)
+/* Measure the transformed strokes of N items in lanes. PAIRS holds the
+   number of points, the context index and the item index of each, the
+   numbers of points and contexts are all the same. */
+{
+        MeasureLanes *lanes;
+        float limits[AVERAGE_LANES], dists[AVERAGE_LANES],
+              angles[AVERAGE_LANES];
+        int live[AVERAGE_LANES], l, points = pairs[0];
+
+        lanes = lanes_get();
+        for (l = 0; l < AVERAGE_LANES; l++) {
+                AverageItem *item;
+                Stroke *a, *b;
+
+                live[l] = FALSE;
+                if (l >= n) {
+                        lanes_clear(lanes, l, points);
+                        continue;
+                }
+                item = items + pairs[3 * l + 2];
+                a = fine_stroke(item->input_stroke, item->input_fine, points,
+                                scratch[0]);
+                b = fine_stroke(item->sample_stroke, item->sample_fine_stroke,
+                                points, scratch[1]);
+                lanes_set(lanes, l, a, b, &item->ic_to_sc, points);
+                limits[l] = item->limit;
+                live[l] = item->limit >= MEASURE_ABANDONED ||
+                          envelope_bound(a, b, &item->ic_to_sc, points,
+                                         FINE_ELASTICITY) <
+                          item->limit * BOUND_MARGIN;
+        }
+        measure_lanes(lanes, n, points, limits, live, dists, angles);
+        for (l = 0; l < n; l++)
+                average_add(items + pairs[3 * l + 2], dists[l], angles[l]);
+}
+#endif
+
+static int average_batch(EngineRange *range, AverageItem *items, int n,
+                         Stroke **scratch)
+/* Run the averages of N items one stroke at a time. Each stroke's distance
+   limit depends on the measures of the strokes before it, so the strokes of
+   an item are measured in order. Returns FALSE if the range was cancelled
+   before all of the strokes were measured. */
+{
+        int pairs[3 * AVERAGE_BATCH], i, k, m, strokes;
+
+        for (k = 0, strokes = 0; k < n; k++)
+                if (items[k].smaller->len > strokes)
+                        strokes = items[k].smaller->len;
+        for (i = 0; i < strokes; i++) {
+
+                /* Stroke pairs that cannot be measured in lanes are measured
+                   right away */
+                for (k = 0, m = 0; k < n; k++) {
+                        AverageItem *item = items + k;
+
+                        if (i >= item->smaller->len)
+                                continue;
+                        if (ENGINE_CANCELLED(range)) {
+                                k = 0;
+                                goto cancelled;
+                        }
+                        engine_count(range, item->k);
+                        average_transform(item, i);
+#if ANGLE_SIZE < 4
+                        if ((pairs[3 * m] = average_lanes_points(item))) {
+                                pairs[3 * m + 1] = item->k;
+                                pairs[3 * m + 2] = k;
+                                m++;
+                                continue;
+                        }
+#endif
+                        average_stroke(item, scratch);
+                }
+
+#if ANGLE_SIZE < 4
+                /* Group the rest by number of points and context */
+                if (m > 1)
+                        qsort(pairs, m, 3 * sizeof (int), lanes_compare);
+                for (k = 0; k < m; ) {
+                        int len;
+
+                        if (ENGINE_CANCELLED(range))
+                                goto cancelled;
+                        len = 1;
+                        while (k + len < m && len < AVERAGE_LANES &&
+                               pairs[3 * (k + len)] == pairs[3 * k] &&
+                               pairs[3 * (k + len) + 1] == pairs[3 * k + 1])
+                                len++;
+                        engine_count(range, pairs[3 * k + 1]);
+                        if (len >= AVERAGE_LANES_MIN) {
+                                average_lanes(items, pairs + 3 * k, len,
+                                              scratch);
+                                k += len;
+                                continue;
+                        }
+                        for (; len > 0; len--, k++)
+                                average_stroke(items + pairs[3 * k + 2],
+                                               scratch);
+                }
+#endif
+        }
+        return TRUE;
+
+cancelled:
+        /* Pairs from K on were transformed but are still waiting for lanes */
+#if ANGLE_SIZE < 4
+        for (; k < m; k++)
+                average_clear(items + pairs[3 * k + 2]);
+#endif
+        return FALSE;
+}
+
+static void average_range(EngineRange *range)
+/* Items are pairs of context index and slot */
+{
+        AverageItem items[AVERAGE_BATCH];
+        Stroke *scratch[2];
+        int i, k, n;
+
+        scratch[0] = stroke_new(POINTS_MAX);
+        scratch[1] = stroke_new(POINTS_MAX);
+        for (i = range->start; i < range->end; i += n) {
+                n = range->end - i;
+                if (n > AVERAGE_BATCH)
+                        n = AVERAGE_BATCH;
+                for (k = 0; k < n; k++) {
+                        int ctx = range->items[2 * (i + k)];
+
+                        average_start(items + k, range->ctxs[ctx], ctx,
+                                      range->items[2 * (i + k) + 1]);
+                }
+                if (!average_batch(range, items, n, scratch))
+                        break;
+                for (k = 0; k < n; k++)
+                        average_finish(items + k);
+        }
+        stroke_free(scratch[0]);
+        stroke_free(scratch[1]);
+}
+
+static int finalist_compare(const void *a, const void *b)
+/* Order samples by character and then by rating, best first */
+{
+        const int *ia = a, *ib = b;
+
+        if (ia[0] != ib[0])
+                return ia[0] - ib[0];
+        return ia[1] != ib[1] ? ib[1] - ia[1] : ia[2] - ib[2];
+}
+
+static void select_finalists(RecognizerContext *ctx)
+/* Disqualify all but the average_finalists samples of each character that
+   the preprocessor rated best. Its rating is the rough measure of the
+   mapping it found, taken on the cached rough strokes, so it costs nothing
+   more to rank the samples by. Like the samples the preprocessor does not
+   qualify, disqualified samples keep their rating, so the preprocessor's
+   engine statistics do not depend on the number of finalists. */
+{
+        GArray *items;
+        int i, ch, kept;
+
+        items = g_array_new(FALSE, FALSE, sizeof (int));
+        for (i = 0; i < store.slots; i++) {
+                int rating;
+
+                if (!store.ch[i] || sample_disqualified(ctx, i))
+                        continue;
+                ch = store.ch[i];
+                rating = ctx->ratings[i][ENGINE_PREP];
+                g_array_append_val(items, ch);
+                g_array_append_val(items, rating);
+                g_array_append_val(items, i);
+        }
+        if (items->len)
+                qsort(items->data, items->len / 3, 3 * sizeof (int),
+                      finalist_compare);
+        for (i = 0, ch = 0, kept = 0; i < items->len / 3; i++) {
+                const int *item = (const int *)items->data + 3 * i;
+
+                if (item[0] != ch) {
+                        ch = item[0];
+                        kept = 0;
+                }
+                if (++kept > average_finalists)
+                        ctx->disqualified[item[2]] = TRUE;
+        }
+        g_array_free(items, TRUE);
 }
 
-void engine_average(void)
+void engine_average(RecognizerContext **ctxs, int len)
 /* Computes average distance and angle differences */
 {
-        Sample *sample;
-        int i;
+        EngineRange ranges[ENGINE_THREADS_MAX];
+        GArray *items;
+        int i, k, n;
 
-        num_disqualified = 0;
         if (!engines[ENGINE_AVGDIST].range &&
             !engines[ENGINE_AVGANGLE].range)
                 return;
 
         /* Average angle engine needs to be discounted when the input
            contains segments too short to produce meaningful angles */
-        engines[ENGINE_AVGANGLE].scale = 0;
-        for (i = 0; i < input->len; i++)
-                if (input->strokes[i]->spread >= DOT_SPREAD)
-                        engines[ENGINE_AVGANGLE].scale++;
-        engines[ENGINE_AVGANGLE].scale = engines[ENGINE_AVGANGLE].scale *
-                                         ENGINE_SCALE / input->len;
-
-        /* Run the averaging engine on every sample */
-        sampleiter_reset();
-        while ((sample = sampleiter_next()))
-                if (sample->ch)
-                        sample_average(sample);
+        for (k = 0; k < len; k++) {
+                Sample *input = ctxs[k]->input;
+                int scale;
+
+                for (i = 0, scale = 0; i < input->len; i++)
+                        if (input->strokes[i]->spread >= DOT_SPREAD)
+                                scale++;
+                ctxs[k]->engines[ENGINE_AVGANGLE].scale = scale *
+                                                          ENGINE_SCALE /
+                                                          input->len;
+        }
+
+        /* Only the finalists of each character are averaged */
+        if (average_finalists > 0)
+                for (k = 0; k < len; k++)
+                        select_finalists(ctxs[k]);
+
+        /* Ignore disqualified samples, keeping the comparisons against each
+           sample together */
+        items = g_array_new(FALSE, FALSE, sizeof (int));
+        for (i = 0; i < store.slots; i++) {
+                if (!store.ch[i])
+                        continue;
+                for (k = 0; k < len; k++) {
+                        int disqualified;
+
+                        disqualified = sample_disqualified(ctxs[k], i);
+                        if (disqualified == 2)
+                                ctxs[k]->num_disqualified++;
+                        if (disqualified)
+                                continue;
+                        g_array_append_val(items, k);
+                        g_array_append_val(items, i);
+                }
+        }
+
+        /* Run the averaging engine on every remaining sample */
+        n = engine_split(ranges, ctxs, len, items->len / 2,
+                         AVERAGE_RANGE_MIN);
+        for (i = 0; i < n; i++)
+                ranges[i].items = (const int *)items->data;
+        engine_run(ranges, n, average_range);
+        g_array_free(items, TRUE);
 }
@@ -35,6 +35,7 @@ int cell_widget_scrollbar_width(void);
 static void start_timeout(void);
 static void show_context_menu(int button, int time);
 static void stop_drawing(void);
+static const char *cell_word(int cell);
 
 /*
         Cells
@@ -86,6 +87,7 @@ static cairo_t *cairo = NULL;
 static PangoContext *pango = NULL;
 static PangoFontDescription *pango_font_desc = NULL;
 static KeyWidget *key_widget;
+static Sample *input = NULL;
 static gunichar *history[HISTORY_MAX];
 static int cell_cols, cell_rows, cell_row_view = 0, current_cell = -1, old_cc,
            cell_cols_saved, cell_rows_saved, cell_row_view_saved,
@@ -760,7 +762,7 @@ static void finish_cell(int cell)
         /* Recognize input */
         else if (input && input->strokes[0] && input->strokes[0]->len) {
                 Cell *pc = cells + cell;
-                int i;
+                int i, ratings[ALTERNATES];
 
                 /* Track stats */
                 if (pc->ch && pc->ch != ' ')
@@ -768,7 +770,10 @@ static void finish_cell(int cell)
                 inputs++;
 
                 old_cc = cell;
-                recognize_sample(input, pc->alts, ALTERNATES);
+                if (!recognize_speculated(input, cell_widget_word(), pc->alts,
+                                          ratings, ALTERNATES))
+                        recognize_sample(input, pc->alts, ratings,
+                                         ALTERNATES);
                 pc->ch = input->ch;
                 pc->flags &= ~CELL_VERIFIED;
                 if (pc->ch)
@@ -777,7 +782,7 @@ static void finish_cell(int cell)
                 /* Copy the alternate ratings and usage stamps before they're
                    overwritten by another call to recognize_sample() */
                 for (i = 0; i < ALTERNATES && pc->alts[i]; i++) {
-                        pc->alt_ratings[i] = pc->alts[i]->rating;
+                        pc->alt_ratings[i] = ratings[i];
                         pc->alt_used[i] = pc->alts[i]->used;
                 }
 
@@ -942,6 +947,13 @@ static void stop_drawing(void)
         process_stroke(stroke);
         render_cell(current_cell);
         render_sample(input, current_cell);
+
+        /* Start recognizing while we wait to see if there is another
+           stroke */
+        if (!training)
+                recognize_speculate(input, cell_word(current_cell),
+                                    ALTERNATES);
+
         start_timeout();
 }
 
@@ -982,6 +994,7 @@ static void check_cell(double x, double y, GdkDevice *device)
 
                 cross_out = TRUE;
                 drawing = FALSE;
+                recognize_cancel();
                 clear_sample(input);
                 input = NULL;
                 erase_cell(current_cell);
@@ -1085,8 +1098,10 @@ static void draw(double x, double y)
                 cells[current_cell].sample.ch = cells[current_cell].ch;
         }
 
-        /* Allocate a new stroke if we aren't already drawing */
+        /* Allocate a new stroke if we aren't already drawing, any result
+           recognized so far is now out of date */
         if (!drawing) {
+                recognize_cancel();
                 if (input->len >= STROKES_MAX)
                         return;
                 input->strokes[input->len++]= stroke_new(0);
@@ -1697,34 +1712,40 @@ int cell_widget_update_colors(void)
                !gdk_colors_equal(&old_select, &color_select);
 }
 
-const char *cell_widget_word(void)
-/* Return the current word and the current cell's position in that word
+static const char *cell_word(int cell)
+/* Return the word around a cell and the cell's position in that word
    FIXME this function ignores wide chars */
 {
         static char buf[64];
         int i, min, max;
 
         memset(buf, 0, sizeof (buf));
-        if (cell_offscreen(old_cc))
+        if (cell_offscreen(cell))
                 return buf;
 
         /* Find the start of the word */
-        for (min = old_cc - 1; min >= 0 && cells[min].ch &&
+        for (min = cell - 1; min >= 0 && cells[min].ch &&
              g_ascii_isalnum(cells[min].ch) && cells[min].ch < 0x7f; min--);
 
         /* Find the end of the word */
-        for (max = old_cc + 1; max < cell_rows * cell_cols && cells[max].ch &&
+        for (max = cell + 1; max < cell_rows * cell_cols && cells[max].ch &&
              g_ascii_isalnum(cells[max].ch) && cells[max].ch < 0x7f; max++);
 
         /* Copy the word to a buffer */
         for (++min, i = 0; i < max - min && i < (int)sizeof (buf) - 1; i++)
                 buf[i] = cells[min + i].ch;
-        buf[old_cc - min] = 0;
+        buf[cell - min] = 0;
         buf[i] = 0;
 
         return buf;
 }
 
+const char *cell_widget_word(void)
+/* Return the current word and the current cell's position in that word */
+{
+        return cell_word(old_cc);
+}
+
 void cell_widget_clear(void)
 {
         stop_timeout();
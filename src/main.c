@@ -33,6 +33,7 @@ extern int strength_sum;
 
 void recognize_init(void);
 void recognize_sync(void);
+void recognize_counters_dump(void);
 void samples_write(void);
 void sample_read(void);
 void update_enabled_samples(void);
@@ -845,6 +846,10 @@ int main(int argc, char *argv[])
         GError *error;
         const char *token;
 
+        /* Initialize GLib threads for the recognition engines */
+        if (!g_thread_supported())
+                g_thread_init(NULL);
+
         /* Initialize GTK+ */
         error = NULL;
         if (!gtk_init_with_args(&argc, &argv,
@@ -967,6 +972,7 @@ int main(int argc, char *argv[])
                         key_overwrites, key_overwrites + key_recycles,
                         key_recycles + key_overwrites ? key_overwrites * 100 /
                         (key_recycles + key_overwrites) : 0);
+                recognize_counters_dump();
         }
 
         return 0;
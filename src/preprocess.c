@@ -23,17 +23,34 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "config.h"
 #include "common.h"
 #include "recognize.h"
+#include <stdlib.h>
 #include <string.h>
 
 /*
         Preprocessing engine
 */
 
-/* Maximum and variable versions of the number of samples to prepare for
-   thorough examination */
-#define PREP_MAX     (SAMPLES_MAX * 4)
+/* Number of samples to prepare for thorough examination */
 #define PREP_SAMPLES (samples_max * 4)
 
+/* Smallest number of samples worth handing to another thread */
+#define PREP_RANGE_MIN 16
+
+/* The index is only used when the store holds this many times as many
+   samples as it is asked for */
+#define INDEX_MIN_RATIO 8
+
+/* Number of samples the index may measure for each one it returns */
+#define INDEX_BUDGET 4
+
+/* Greedy mapping of samples with at least this many strokes measures the
+   candidates for a target stroke on the worker pool when the pass over the
+   store was not split */
+#define MAP_PARALLEL_STROKES 12
+
+/* Smallest number of candidates worth handing to another thread */
+#define MAP_RANGE_MIN 4
+
 /* Greedy mapping */
 #define VALUE_MAX 2048.f
 #define VALUE_MIN 1024.f
@@ -43,30 +60,225 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define GLUABLE_PENALTY   0.08f
 #define GLUE_PENALTY      0.02f
 
-int ignore_stroke_dir = TRUE, ignore_stroke_num = TRUE, prep_examined;
+int ignore_stroke_dir = TRUE, ignore_stroke_num = TRUE;
+
+/* Prefilter cascade limits, zero disables a stage. Stroke counts may differ
+   by prefilter_strokes, bounding box sizes by prefilter_size percent of the
+   cell and the amount of ink by a ratio of prefilter_ink percent. Samples
+   whose vertical displacement penalty alone rules them out are dropped if
+   prefilter_vertical is set. At most prefilter_cap samples that pass are
+   mapped. The stages can rule out samples that would have been ranked, so
+   they are all disabled unless configured. In large stores, only the
+   prefilter_index samples nearest to the input in the sample index are
+   considered at all. */
+int prefilter_strokes = 0, prefilter_vertical = FALSE, prefilter_size = 0,
+    prefilter_ink = 0, prefilter_cap = 0, prefilter_index = 300;
+
+/* Strokes reused by greedy mapping so that measuring a candidate does not
+   allocate. Glued holds the strokes already glued together for the current
+   target stroke, candidates are built on top of it. Parallel is set if
+   candidates may be measured on the worker pool. */
+typedef struct {
+        Stroke *glued, *candidate, *sampled;
+        int parallel;
+} MapBuffers;
+
+static void map_buffers_init(MapBuffers *buffers)
+{
+        buffers->glued = stroke_new(0);
+        buffers->candidate = stroke_new(0);
+        buffers->sampled = stroke_new(POINTS_MAX);
+        buffers->parallel = FALSE;
+}
 
-static float measure_partial(Stroke *as, Stroke *b, Vec2 *offset, float scale_b)
+static void map_buffers_free(MapBuffers *buffers)
+{
+        stroke_free(buffers->glued);
+        stroke_free(buffers->candidate);
+        stroke_free(buffers->sampled);
+}
+
+static float measure_partial(Stroke *as, Stroke *b, Vec2 *offset, float scale_b,
+                             Stroke *buffer, float limit)
 {
         Stroke *bs;
-        float value;
         int b_len, min_len;
 
         b_len = b->distance * scale_b / ROUGH_RESOLUTION + 0.5;
         if (b_len < 4)
                 b_len = 4;
         min_len = as->len >= b_len ? b_len : as->len;
-        bs = sample_stroke(NULL, b, b_len, min_len);
-        value = measure_strokes(as, bs, (MeasureFunc)measure_distance, offset,
-                                min_len, ROUGH_ELASTICITY);
-        stroke_free(bs);
-        return value;
+        bs = sample_stroke(buffer, b, b_len, min_len);
+        return measure_strokes(as, bs, (MeasureFunc)measure_distance, offset,
+                               min_len, ROUGH_ELASTICITY, limit);
+}
+
+static Stroke *map_candidate(MapBuffers *buffers, Sample *larger, int j,
+                             int glue, int reverse)
+/* Get stroke J glued onto the end of the strokes already mapped. This is
+   the same stroke transform_stroke() would build for the transform. */
+{
+        if (glue) {
+                copy_stroke(&buffers->candidate, buffers->glued, FALSE);
+                glue_stroke(&buffers->candidate, larger->strokes[j], reverse);
+                return buffers->candidate;
+        }
+        if (!reverse)
+                return larger->strokes[j];
+        copy_stroke(&buffers->candidate, larger->strokes[j], TRUE);
+        return buffers->candidate;
+}
+
+static int map_glue_check(Sample *larger, const Transform *tfm, int last_j,
+                          int j, int reverse, unsigned char *gluable,
+                          float *reach)
+/* Check if stroke J can be glued onto stroke LAST_J in the given direction
+   and get the gluing penalty and the inter-stroke (reach) distance */
+{
+        Vec2 v;
+        Point *p1, *p2;
+        unsigned char gluable2;
+
+        *gluable = sample_gluable(larger, j, last_j, reverse);
+        gluable2 = sample_gluable(larger, last_j, j, !reverse);
+        if (gluable2 < *gluable)
+                *gluable = gluable2;
+        if (*gluable >= GLUABLE_MAX)
+                return FALSE;
+        p1 = larger->strokes[last_j]->points +
+             (tfm->reverse[last_j] ? 0 : larger->strokes[last_j]->len - 1);
+        p2 = larger->strokes[j]->points +
+             (!reverse ? 0 : larger->strokes[j]->len - 1);
+        vec2_set(&v, p2->x - p1->x, p2->y - p1->y);
+        *reach = vec2_mag(&v);
+        return TRUE;
+}
+
+static int map_glue(Sample *larger, const Transform *tfm, int last_j, int j,
+                    int reverse, unsigned char *gluable, float *reach)
+/* Glue check made by greedy mapping. Candidates measured ahead of time on
+   the worker pool are checked again by greedy mapping, so only this one is
+   counted. */
+{
+        counter_add(COUNTER_GLUES, 1);
+        return map_glue_check(larger, tfm, last_j, j, reverse, gluable, reach);
+}
+
+static int map_oversize(Sample *larger, Sample *smaller, int i, int j,
+                        float seg_dist)
+/* Do not glue on oversize segments */
+{
+        return seg_dist + larger->strokes[j]->distance / 2 >
+               smaller->strokes[i]->distance &&
+               (larger->strokes[j]->spread > DOT_SPREAD ||
+                smaller->strokes[i]->spread > DOT_SPREAD);
+}
+
+/* A step of greedy mapping whose candidates are measured ahead of time on
+   the worker pool. Candidates are the stroke number in the larger sample
+   doubled, plus one if the stroke is reversed. Values are indexed the same
+   way. */
+typedef struct {
+        Sample *larger, *smaller;
+        Stroke *glued;
+        const Transform *tfm;
+        Vec2 *offset;
+        float reach;
+        int i, glue, last_j, len, candidates[2 * STROKES_MAX];
+        float values[2 * STROKES_MAX];
+} MapStep;
+
+static void map_range(EngineRange *range)
+/* Measure a range of the candidates of a step. A candidate is only
+   abandoned if it cannot beat an earlier one, so the sequential choice of
+   candidate does not change. */
+{
+        MapStep *step = range->data;
+        MapBuffers buffers;
+        float best = VALUE_MAX;
+        int n;
+
+        buffers.glued = step->glued;
+        buffers.candidate = stroke_new(0);
+        buffers.sampled = stroke_new(POINTS_MAX);
+        for (n = range->start; n < range->end; n++) {
+                Stroke *stroke;
+                float reach = 0.f, value;
+                unsigned char gluable;
+                int j, reverse;
+
+                j = step->candidates[n] / 2;
+                reverse = step->candidates[n] % 2;
+                if (step->glue)
+                        map_glue_check(step->larger, step->tfm, step->last_j,
+                                       j, reverse, &gluable, &reach);
+                stroke = map_candidate(&buffers, step->larger, j, step->glue,
+                                       reverse);
+                value = measure_partial(step->smaller->roughs[step->i], stroke,
+                                        step->offset,
+                                        step->smaller->distance /
+                                        (reach + step->reach +
+                                         step->larger->distance),
+                                        buffers.sampled, best);
+                step->values[step->candidates[n]] = value;
+                if (value < best)
+                        best = value;
+        }
+        stroke_free(buffers.candidate);
+        stroke_free(buffers.sampled);
+}
+
+static int map_step(MapStep *step, float seg_dist)
+/* Find the candidates greedy mapping would measure in the same order and
+   measure them on the worker pool. Returns FALSE if there are too few
+   candidates or threads to bother. */
+{
+        EngineRange ranges[ENGINE_THREADS_MAX];
+        const Transform *tfm = step->tfm;
+        Sample *larger = step->larger;
+        int j, n, reverse;
+
+        for (j = 0, step->len = 0; j < larger->len; j++) {
+                unsigned char gluable;
+                float reach;
+
+                if (tfm->order[j] ||
+                    map_oversize(larger, step->smaller, step->i, j, seg_dist))
+                        continue;
+                reverse = FALSE;
+                if (step->glue && !map_glue_check(larger, tfm, step->last_j,
+                                                  j, FALSE, &gluable,
+                                                  &reach)) {
+                        if (!ignore_stroke_dir)
+                                continue;
+                        reverse = TRUE;
+                        if (!map_glue_check(larger, tfm, step->last_j, j,
+                                            TRUE, &gluable, &reach))
+                                continue;
+                }
+                step->candidates[step->len++] = 2 * j + reverse;
+                if (ignore_stroke_dir && !reverse &&
+                    larger->strokes[j]->spread > DOT_SPREAD &&
+                    (!step->glue || map_glue_check(larger, tfm, step->last_j,
+                                                   j, TRUE, &gluable,
+                                                   &reach)))
+                        step->candidates[step->len++] = 2 * j + 1;
+        }
+        n = engine_split(ranges, NULL, 0, step->len, MAP_RANGE_MIN);
+        if (n < 2)
+                return FALSE;
+        for (j = 0; j < n; j++)
+                ranges[j].data = step;
+        engine_run(ranges, n, map_range);
+        return TRUE;
 }
 
 static float greedy_map(Sample *larger, Sample *smaller, Transform *ptfm,
-                        Vec2 *offset)
+                        Vec2 *offset, float *ppenalty, MapBuffers *buffers)
 {
         Transform tfm;
-        int i, unmapped_len;
+        MapStep step;
+        int i, unmapped_len, parallel, measured;
         float total;
 
         unmapped_len = larger->len;
@@ -76,12 +288,30 @@ static float greedy_map(Sample *larger, Sample *smaller, Transform *ptfm,
         *ptfm = tfm;
         tfm.valid = TRUE;
 
+        /* Measure the candidates of each step on the worker pool if there
+           are enough of them */
+        parallel = buffers->parallel && larger->len >= MAP_PARALLEL_STROKES;
+        step.larger = larger;
+        step.smaller = smaller;
+        step.glued = buffers->glued;
+        step.tfm = &tfm;
+        step.offset = offset;
+
         for (i = 0, total = 0.f; i < smaller->len; i++) {
                 float best, best_reach = G_MAXFLOAT, best_value = G_MAXFLOAT,
                       value, penalty = G_MAXFLOAT, seg_dist = 0.f;
                 int j, last_j = 0, best_j = 0, glue = 0;
 
         glue_more:
+                measured = FALSE;
+                if (parallel) {
+                        step.glued = buffers->glued;
+                        step.reach = ptfm->reach;
+                        step.i = i;
+                        step.glue = glue;
+                        step.last_j = last_j;
+                        measured = map_step(&step, seg_dist);
+                }
                 for (j = 0, best = G_MAXFLOAT; j < larger->len; j++) {
                         Stroke *stroke;
                         float reach, scale;
@@ -90,70 +320,44 @@ static float greedy_map(Sample *larger, Sample *smaller, Transform *ptfm,
                         if (tfm.order[j])
                                 continue;
                         tfm.reverse[j] = FALSE;
-
-                        /* Do not glue on oversize segments */
-                        if (seg_dist +
-                            larger->strokes[j]->distance / 2 >
-                            smaller->strokes[i]->distance &&
-                            (larger->strokes[j]->spread > DOT_SPREAD ||
-                             smaller->strokes[i]->spread > DOT_SPREAD))
+                        if (map_oversize(larger, smaller, i, j, seg_dist))
                                 continue;
-
                         tfm.order[j] = i + 1;
                         tfm.glue[j] = glue;
 
                 measure:
                         reach = 0.f;
                         gluable = 0;
-                        if (glue) {
-                                Vec2 v;
-                                Point *p1, *p2;
-                                unsigned char gluable2;
-
-                                /* Can we glue these strokes together? */
-                                if (!tfm.reverse[j]) {
-                                        gluable = larger->strokes[j]->
-                                                  gluable_start[last_j];
-                                        gluable2 = larger->strokes[last_j]->
-                                                   gluable_end[j];
-                                        if (gluable2 < gluable)
-                                                gluable = gluable2;
-                                        if (gluable >= GLUABLE_MAX) {
-                                                if (!ignore_stroke_dir)
-                                                        continue;
-                                                tfm.reverse[j] = TRUE;
-                                        }
-                                }
-                                if (tfm.reverse[j]) {
-                                        gluable = larger->strokes[j]->
-                                                  gluable_end[last_j];
-                                        gluable2 = larger->strokes[last_j]->
-                                                   gluable_start[j];
-                                        if (gluable2 < gluable)
-                                                gluable = gluable2;
-                                        if (gluable >= GLUABLE_MAX)
-                                                continue;
-                                }
-
-                                /* Get the inter-stroke (reach) distance */
-                                p1 = larger->strokes[last_j]->points +
-                                     (tfm.reverse[last_j] ? 0 :
-                                      larger->strokes[last_j]->len - 1);
-                                p2 = larger->strokes[j]->points +
-                                     (!tfm.reverse[j] ? 0 :
-                                      larger->strokes[j]->len - 1);
-                                vec2_set(&v, p2->x - p1->x,
-                                         p2->y - p1->y);
-                                reach = vec2_mag(&v);
+
+                        /* Can we glue these strokes together? */
+                        if (glue && !map_glue(larger, &tfm, last_j, j,
+                                              tfm.reverse[j], &gluable,
+                                              &reach)) {
+                                if (tfm.reverse[j] || !ignore_stroke_dir)
+                                        goto unmapped;
+                                tfm.reverse[j] = TRUE;
+                                if (!map_glue(larger, &tfm, last_j, j, TRUE,
+                                              &gluable, &reach))
+                                        goto unmapped;
                         }
 
-                        /* Transform and measure the distance */
-                        stroke = transform_stroke(larger, &tfm, i);
-                        scale = smaller->distance /
-                                (reach + ptfm->reach + larger->distance);
-                        value = measure_partial(smaller->roughs[i], stroke,
-                                                offset, scale);
-                        stroke_free(stroke);
+                        /* Transform and measure the distance. Candidates
+                           that cannot beat the best one so far need not be
+                           measured exactly. */
+                        if (measured)
+                                value = step.values[2 * j + tfm.reverse[j]];
+                        else {
+                                stroke = map_candidate(buffers, larger, j, glue,
+                                                       tfm.reverse[j]);
+                                scale = smaller->distance /
+                                        (reach + ptfm->reach +
+                                         larger->distance);
+                                value = measure_partial(smaller->roughs[i],
+                                                        stroke, offset, scale,
+                                                        buffers->sampled,
+                                                        best < VALUE_MAX ?
+                                                        best : VALUE_MAX);
+                        }
 
                         /* Keep track of the best result */
                         if (value < best && value < VALUE_MAX) {
@@ -179,18 +383,31 @@ static float greedy_map(Sample *larger, Sample *smaller, Transform *ptfm,
                                 goto measure;
                         }
 
+                        /* Strokes that could not be glued on are untagged
+                           too, so that they are neither built into later
+                           candidates nor kept from being mapped */
+                unmapped:
                         tfm.reverse[j] = FALSE;
                         tfm.order[j] = 0;
                 }
                 if (best < G_MAXFLOAT) {
                         best_value = best;
-                        larger->penalty += penalty;
-                        smaller->penalty += penalty;
+                        *ppenalty += penalty;
                         seg_dist += best_reach +
                                     larger->strokes[best_j]->distance;
                         ptfm->reach += best_reach;
                         tfm = *ptfm;
 
+                        /* Extend the glued stroke with the mapped stroke */
+                        if (glue)
+                                glue_stroke(&buffers->glued,
+                                            larger->strokes[best_j],
+                                            tfm.reverse[best_j]);
+                        else
+                                copy_stroke(&buffers->glued,
+                                            larger->strokes[best_j],
+                                            tfm.reverse[best_j]);
+
                         /* If we still have strokes and we didn't just add on
                            a dot, try gluing them on */
                         unmapped_len--;
@@ -221,18 +438,15 @@ static float greedy_map(Sample *larger, Sample *smaller, Transform *ptfm,
         return total / smaller->len;
 }
 
-static int prep_sample(Sample *sample)
+static int prep_sample(RecognizerContext *ctx, Sample *sample, int slot,
+                       MapBuffers *buffers)
 {
+        Sample *input = ctx->input;
+        Transform *tfm = ctx->transforms + slot;
         Vec2 offset;
         float dist;
 
-        /* Structural disqualification */
-        if (!sample->used || !sample->enabled ||
-            (!ignore_stroke_num && sample->len != input->len))
-                return FALSE;
-
-        prep_examined++;
-        sample->penalty = 0.f;
+        ctx->penalty[slot] = 0.f;
 
         /* Account for displacement */
         center_samples(&offset, sample, input);
@@ -241,12 +455,14 @@ static int prep_sample(Sample *sample)
            generate the stroke order information which will be used by other
            engines */
         if (input->len >= sample->len)
-                dist = greedy_map(input, sample, &sample->transform, &offset);
+                dist = greedy_map(input, sample, tfm, &offset,
+                                  ctx->penalty + slot, buffers);
         else {
                 vec2_set(&offset, -offset.x, -offset.y);
-                dist = greedy_map(sample, input, &sample->transform, &offset);
+                dist = greedy_map(sample, input, tfm, &offset,
+                                  ctx->penalty + slot, buffers);
         }
-        if (!sample->transform.valid)
+        if (!tfm->valid)
                 return FALSE;
 
         /* Undo square distortion */
@@ -255,45 +471,213 @@ static int prep_sample(Sample *sample)
                 return FALSE;
 
         /* Penalize vertical displacement */
-        sample->penalty += VERTICAL_PENALTY *
-                           offset.y * offset.y / SCALE / SCALE;
+        ctx->penalty[slot] += VERTICAL_PENALTY *
+                              offset.y * offset.y / SCALE / SCALE;
 
-        sample->ratings[ENGINE_PREP] = RATING_MAX -
-                                       RATING_MAX * dist / MAX_DIST;
+        ctx->ratings[slot][ENGINE_PREP] = RATING_MAX -
+                                          RATING_MAX * dist / MAX_DIST;
         return TRUE;
 }
 
-void engine_prep(void)
+static int prefilter(const SampleFeatures *a, int a_len, int slot,
+                     int *score)
+/* Check a sample against the input using only cheap features. Returns the
+   prefilter stage that rules it out or -1 if it passes. Score is lower the
+   closer the features match. */
+{
+        const SampleFeatures *b = store.features + slot;
+        float dy, ink_min, ink_max;
+        int strokes, size;
+
+        /* Stroke count */
+        strokes = a_len - store.len[slot];
+        if (strokes < 0)
+                strokes = -strokes;
+        if (prefilter_strokes && strokes > prefilter_strokes)
+                return PREFILTER_STROKES;
+
+        /* The vertical displacement penalty alone will rule it out */
+        dy = b->center_y - a->center_y;
+        if (prefilter_vertical &&
+            VERTICAL_PENALTY * dy * dy / SCALE / SCALE >= 1.f)
+                return PREFILTER_VERTICAL;
+
+        /* Bounding box size */
+        size = (a->width > b->width ? a->width - b->width :
+                                      b->width - a->width) +
+               (a->height > b->height ? a->height - b->height :
+                                        b->height - a->height);
+        if (prefilter_size && size * 100 > prefilter_size * SCALE)
+                return PREFILTER_SIZE;
+
+        /* Amount of ink */
+        ink_min = a->distance < b->distance ? a->distance : b->distance;
+        ink_max = a->distance < b->distance ? b->distance : a->distance;
+        if (prefilter_ink && ink_max * 100 > ink_min * prefilter_ink)
+                return PREFILTER_INK;
+
+        *score = size + (dy >= 0.f ? dy : -dy) +
+                 (ink_max - ink_min) / (a_len > 1 ? a_len : 1);
+        return -1;
+}
+
+static void prep_range(EngineRange *range)
+/* Items are pairs of context index and slot */
 {
-        Sample *sample, *list[PREP_MAX];
+        MapBuffers buffers;
         int i;
 
-        /* Rate every sample in every possible configuration */
-        list[0] = NULL;
-        prep_examined = 0;
-        sampleiter_reset();
-        while ((sample = sampleiter_next())) {
-                sample->disqualified = TRUE;
-                if (!sample->used || !sample->ch || !prep_sample(sample))
-                        continue;
+        map_buffers_init(&buffers);
+        buffers.parallel = range->split < 2;
+        for (i = range->start; i < range->end; i++) {
+                RecognizerContext *ctx;
+                int slot;
+
+                if (ENGINE_CANCELLED(range))
+                        break;
+                ctx = range->ctxs[range->items[2 * i]];
+                slot = range->items[2 * i + 1];
+                engine_count(range, range->items[2 * i]);
+                if (prep_sample(ctx, sample_at(slot), slot, &buffers))
+                        topk_add(range->best + range->items[2 * i], slot,
+                                 ctx->ratings[slot][ENGINE_PREP]);
+        }
+        map_buffers_free(&buffers);
+}
 
-                /* Bubble-sort sample into the list */
-                for (i = 0; i < PREP_SAMPLES; i++)
-                        if (!list[i]) {
-                                list[i] = sample;
-                                if (i < PREP_MAX - 1)
-                                        list[i + 1] = NULL;
-                                break;
-                        } else if (list[i]->ratings[ENGINE_PREP] <
-                                   sample->ratings[ENGINE_PREP]) {
-                                memmove(list + i + 1, list + i,
-                                        (PREP_MAX - i - 1) * sizeof (*list));
-                                list[i] = sample;
-                                break;
+static void add_item(GArray *items, int k, int slot)
+{
+        g_array_append_val(items, k);
+        g_array_append_val(items, slot);
+}
+
+static int item_compare(const void *a, const void *b)
+/* Order context and slot pairs by slot */
+{
+        const int *ia = a, *ib = b;
+
+        return ia[1] != ib[1] ? ia[1] - ib[1] : ia[0] - ib[0];
+}
+
+static void prefilter_slot(RecognizerContext *ctx,
+                           const SampleFeatures *features, TopK *cap,
+                           GArray *items, int k, int slot)
+/* Run the prefilter cascade on a sample, keeping it if it passes. If the
+   samples are capped, those whose features match most closely are kept. */
+{
+        int stage, score;
+
+        ctx->prep_examined++;
+        stage = prefilter(features, ctx->input->len, slot, &score);
+        if (stage >= 0) {
+                ctx->counters.pruned[stage]++;
+                return;
+        }
+        if (prefilter_cap > 0) {
+                if (cap->len >= prefilter_cap)
+                        ctx->counters.pruned[PREFILTER_CAP]++;
+                topk_add(cap, slot, -score);
+                return;
+        }
+        add_item(items, k, slot);
+}
+
+void engine_prep(RecognizerContext **ctxs, int len)
+{
+        EngineRange ranges[ENGINE_THREADS_MAX];
+        SampleFeatures features[len];
+        TopK caps[len];
+        GArray *items;
+        int i, j, k, n;
+
+        for (k = 0; k < len; k++) {
+                sample_features(features + k, ctxs[k]->input);
+                memset(ctxs[k]->disqualified, TRUE, store.slots);
+                if (prefilter_cap > 0)
+                        topk_init(caps + k, prefilter_cap, FALSE);
+        }
+        items = g_array_new(FALSE, FALSE, sizeof (int));
+
+        /* In large stores only the samples the index finds nearest to the
+           input go through the prefilter cascade */
+        n = sample_index_size();
+        if (prefilter_index > 0 && n > prefilter_index * INDEX_MIN_RATIO) {
+                int *slots;
+
+                slots = g_new(int, prefilter_index);
+                for (k = 0; k < len; k++) {
+                        j = sample_index_query(ctxs[k]->input, prefilter_index,
+                                               prefilter_index * INDEX_BUDGET,
+                                               slots);
+                        ctxs[k]->counters.pruned[PREFILTER_INDEX] += n - j;
+                        for (i = 0; i < j; i++)
+                                prefilter_slot(ctxs[k], features + k, caps + k,
+                                               items, k, slots[i]);
+                }
+                g_free(slots);
+        } else
+
+                /* Otherwise run the prefilter cascade on every sample */
+                for (i = 0; i < store.slots; i++) {
+
+                        /* Structural disqualification */
+                        if (!store.used[i] || !store.ch[i] || !store.enabled[i])
+                                continue;
+
+                        for (k = 0; k < len; k++) {
+                                if (!ignore_stroke_num &&
+                                    store.len[i] != ctxs[k]->input->len)
+                                        continue;
+                                prefilter_slot(ctxs[k], features + k, caps + k,
+                                               items, k, i);
                         }
+                }
+
+        /* Only map the closest samples if there are too many */
+        if (prefilter_cap > 0)
+                for (k = 0; k < len; k++) {
+                        for (j = 0; j < caps[k].len; j++)
+                                add_item(items, k, caps[k].heap[j].slot);
+                        topk_cleanup(caps + k);
+                }
+
+        /* Rate every remaining sample in every possible configuration,
+           keeping the comparisons against each sample together */
+        if (items->len)
+                qsort(items->data, items->len / 2, 2 * sizeof (int),
+                      item_compare);
+        n = engine_split(ranges, ctxs, len, items->len / 2, PREP_RANGE_MIN);
+        for (i = 0; i < n; i++) {
+                ranges[i].items = (const int *)items->data;
+                ranges[i].best = g_new(TopK, len);
+                for (k = 0; k < len; k++)
+                        topk_init(ranges[i].best + k, PREP_SAMPLES, FALSE);
         }
+        engine_run(ranges, n, prep_range);
+        g_array_free(items, TRUE);
+
+        /* Merge the best samples of each range. The selection does not
+           depend on the order the samples are added in so the result is
+           the same for any number of ranges. */
+        for (k = 0; k < len; k++) {
+                RecognizerContext *ctx = ctxs[k];
+                TopK best;
+
+                topk_init(&best, PREP_SAMPLES, FALSE);
+                for (i = 0; i < n; i++) {
+                        TopK *part = ranges[i].best + k;
+
+                        for (j = 0; j < part->len; j++)
+                                topk_add(&best, part->heap[j].slot,
+                                         part->heap[j].rating);
+                        topk_cleanup(part);
+                }
 
-        /* Qualify the best samples */
-        for (i = 0; i < PREP_SAMPLES && list[i]; i++)
-                list[i]->disqualified = FALSE;
+                /* Qualify the best samples */
+                for (i = 0; i < best.len; i++)
+                        ctx->disqualified[best.heap[i].slot] = FALSE;
+                topk_cleanup(&best);
+        }
+        for (i = 0; i < n; i++)
+                g_free(ranges[i].best);
 }
@@ -24,14 +24,16 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <unistd.h>
 #include <gtk/gtk.h>
 #include "common.h"
 #include "recognize.h"
 
 /* preprocess.c */
-int prep_examined;
+void engine_prep(RecognizerContext **ctxs, int len);
 
-void engine_prep(void);
+/* cellwidget.c */
+const char *cell_widget_word(void);
 
 /*
         Engines
@@ -40,78 +42,774 @@ void engine_prep(void);
 Engine engines[] = {
 
         /* Preprocessor engine must run first */
-        { "Key-point distance", engine_prep, MAX_RANGE, TRUE, -1, 0, 0 },
+        { "Key-point distance", engine_prep, MAX_RANGE, TRUE, -1 },
 
         /* Averaging engines */
-        { "Average distance", engine_average, MAX_RANGE, TRUE, -1, 0, 0 },
-        { "Average angle", NULL, MAX_RANGE, TRUE, 0, 0, 0 },
+        { "Average distance", engine_average, MAX_RANGE, TRUE, -1 },
+        { "Average angle", NULL, MAX_RANGE, TRUE, 0 },
 
 #ifndef DISABLE_WORDFREQ
         /* Word frequency engine */
-        { "Word context", engine_wordfreq, MAX_RANGE / 3, FALSE, -1, 0, 0 },
+        { "Word context", engine_wordfreq, MAX_RANGE / 3, FALSE, -1 },
 #endif
 };
 
-static int engine_rating(const Sample *sample, int j)
+static int engine_rating(const RecognizerContext *ctx, int slot, int j)
 /* Get the processed rating for engine j on a sample */
 {
+        const EngineStats *stats = ctx->engines + j;
         int value;
 
-        if (!engines[j].range || engines[j].max < 1)
+        if (!engines[j].range || stats->max < 1)
                 return 0;
-        value = ((int)sample->ratings[j] - engines[j].average) *
-                engines[j].range / engines[j].max;
-        if (engines[j].scale >= 0)
-                value = value * engines[j].scale / ENGINE_SCALE;
+        value = ((int)ctx->ratings[slot][j] - stats->average) *
+                engines[j].range / stats->max;
+        if (stats->scale >= 0)
+                value = value * stats->scale / ENGINE_SCALE;
         return value;
 }
 
 /*
-        Sample chain wrapper
+        Sample index
 */
 
-typedef struct SampleLink {
-        Sample sample;
-        struct SampleLink *prev, *next;
-} SampleLink;
+/* Samples are indexed in a vantage-point tree over their descriptors. Each
+   inner node splits the samples below it into those closer to its vantage
+   point than its radius and the rest. Samples are kept in leaves that are
+   split once they hold more than INDEX_LEAF_MAX samples. Vantage points are
+   copied into the nodes so samples can be removed without restructuring the
+   tree. */
+#define INDEX_LEAF_MAX 32
+
+typedef struct {
+        unsigned char vantage[DESCRIPTOR_LEN];
+        float radius;
+        int inside, outside, split_len;
+        GArray *slots;
+} IndexNode;
+
+static GArray *index_nodes = NULL, *index_leaves = NULL;
+static int index_len = 0;
+
+static float descriptor_distance(const unsigned char *a, const unsigned char *b)
+/* Euclidean distance between two descriptors */
+{
+        int i, sum = 0;
+
+        for (i = 0; i < DESCRIPTOR_LEN; i++) {
+                int d = a[i] - b[i];
+
+                sum += d * d;
+        }
+        return sqrtf(sum);
+}
+
+static int index_leaf_new(void)
+{
+        IndexNode node;
+
+        memset(&node, 0, sizeof (node));
+        node.slots = g_array_new(FALSE, FALSE, sizeof (int));
+        g_array_append_val(index_nodes, node);
+        return index_nodes->len - 1;
+}
+
+static int distance_compare(const void *a, const void *b)
+{
+        float fa = *(const float *)a, fb = *(const float *)b;
+
+        return fa < fb ? -1 : fa > fb;
+}
+
+static float index_radius(GArray *slots, int len, float *dists)
+/* Measure the first LEN samples of a leaf from the first one and find the
+   median distance to it that separates them. Returns zero if they are all
+   copies of the first sample. */
+{
+        const unsigned char *vantage;
+        float sorted[INDEX_LEAF_MAX * 2], radius;
+        int i;
+
+        vantage = sample_at(g_array_index(slots, int, 0))->descriptor;
+        for (i = 0; i < len; i++)
+                dists[i] = descriptor_distance(vantage, sample_at(
+                                g_array_index(slots, int, i))->descriptor);
+        memcpy(sorted, dists, len * sizeof (*dists));
+        qsort(sorted, len, sizeof (*sorted), distance_compare);
+        radius = sorted[len / 2];
+        if (radius <= sorted[0]) {
+                for (i = len / 2; i < len && sorted[i] <= sorted[0]; i++);
+                if (i >= len)
+                        return 0.f;
+                radius = sorted[i];
+        }
+        return radius;
+}
+
+static void index_split(int n)
+/* Turn a full leaf into an inner node with two leaves. The first sample is
+   the vantage point and the median distance to it the radius. If the first
+   samples are all copies of it, the sample farthest from it is moved to the
+   front and used instead. Leaves of copies cannot be split and are only
+   tried again once they have doubled. */
+{
+        IndexNode *node;
+        GArray *slots;
+        const unsigned char *vantage;
+        float dists[INDEX_LEAF_MAX * 2], radius;
+        int i, len, inside, outside;
+
+        node = &g_array_index(index_nodes, IndexNode, n);
+        slots = node->slots;
+        len = slots->len;
+        if (len > INDEX_LEAF_MAX * 2)
+                len = INDEX_LEAF_MAX * 2;
+        radius = index_radius(slots, len, dists);
+        if (radius <= 0.f) {
+                float far_dist = 0.f;
+                int far = 0, swap;
+
+                vantage = sample_at(g_array_index(slots, int, 0))->descriptor;
+                for (i = len; i < (int)slots->len; i++) {
+                        float dist;
+
+                        dist = descriptor_distance(vantage, sample_at(
+                                g_array_index(slots, int, i))->descriptor);
+                        if (dist > far_dist) {
+                                far = i;
+                                far_dist = dist;
+                        }
+                }
+                if (!far) {
+                        node->split_len = slots->len * 2;
+                        return;
+                }
+                swap = g_array_index(slots, int, 0);
+                g_array_index(slots, int, 0) = g_array_index(slots, int, far);
+                g_array_index(slots, int, far) = swap;
+                radius = index_radius(slots, len, dists);
+        }
+        vantage = sample_at(g_array_index(slots, int, 0))->descriptor;
+
+        /* Leaves are appended so the node has to be looked up again */
+        inside = index_leaf_new();
+        outside = index_leaf_new();
+        node = &g_array_index(index_nodes, IndexNode, n);
+        memcpy(node->vantage, vantage, sizeof (node->vantage));
+        node->radius = radius;
+        node->inside = inside;
+        node->outside = outside;
+        node->slots = NULL;
+        for (i = 0; i < (int)slots->len; i++) {
+                int slot = g_array_index(slots, int, i), leaf;
+                float dist;
+
+                dist = i < len ? dists[i] :
+                       descriptor_distance(node->vantage,
+                                           sample_at(slot)->descriptor);
+                leaf = dist < radius ? inside : outside;
+                g_array_append_val(g_array_index(index_nodes, IndexNode,
+                                                 leaf).slots, slot);
+                g_array_index(index_leaves, int, slot) = leaf;
+        }
+        g_array_free(slots, TRUE);
+}
+
+static void index_remove(int slot)
+/* Remove a slot from the index if it is in it */
+{
+        GArray *slots;
+        int i, leaf;
+
+        if (!index_leaves || slot >= (int)index_leaves->len ||
+            (leaf = g_array_index(index_leaves, int, slot)) < 0)
+                return;
+        slots = g_array_index(index_nodes, IndexNode, leaf).slots;
+        for (i = 0; i < (int)slots->len; i++)
+                if (g_array_index(slots, int, i) == slot) {
+                        g_array_remove_index_fast(slots, i);
+                        break;
+                }
+        g_array_index(index_leaves, int, slot) = -1;
+        index_len--;
+}
+
+static void index_insert(int slot)
+/* Add the sample in a slot to the index */
+{
+        IndexNode *node;
+        const unsigned char *descriptor;
+        int n = 0, none = -1;
+
+        if (!index_nodes) {
+                index_nodes = g_array_new(FALSE, FALSE, sizeof (IndexNode));
+                index_leaves = g_array_new(FALSE, FALSE, sizeof (int));
+                index_leaf_new();
+        }
+        while ((int)index_leaves->len <= slot)
+                g_array_append_val(index_leaves, none);
+        descriptor = sample_at(slot)->descriptor;
+        for (;;) {
+                node = &g_array_index(index_nodes, IndexNode, n);
+                if (node->slots)
+                        break;
+                n = descriptor_distance(descriptor, node->vantage) <
+                    node->radius ? node->inside : node->outside;
+        }
+        g_array_append_val(node->slots, slot);
+        g_array_index(index_leaves, int, slot) = n;
+        index_len++;
+        if (node->slots->len > INDEX_LEAF_MAX &&
+            node->slots->len >= node->split_len)
+                index_split(n);
+}
+
+static void index_update(int slot)
+/* Reindex a slot after the sample in it has changed */
+{
+        index_remove(slot);
+        if (store.ch[slot] && store.used[slot])
+                index_insert(slot);
+}
+
+static float index_reach(const TopK *best)
+/* Distance within which a sample could still be among the nearest. Ratings
+   are truncated so this rounds up. */
+{
+        if (best->len < best->size)
+                return G_MAXFLOAT;
+        return (1 - best->heap[0].rating) / 256.f;
+}
+
+typedef struct {
+        float bound;
+        int node;
+} IndexVisit;
+
+static void index_push(GArray *heap, int node, float bound)
+/* Add a node to the min-heap of nodes left to visit */
+{
+        IndexVisit visit = {bound, node}, *v;
+        int i;
+
+        g_array_append_val(heap, visit);
+        v = (IndexVisit *)heap->data;
+        for (i = heap->len - 1; i > 0 && v[(i - 1) / 2].bound > bound;
+             i = (i - 1) / 2)
+                v[i] = v[(i - 1) / 2];
+        v[i] = visit;
+}
+
+static IndexVisit index_pop(GArray *heap)
+/* Remove the node with the lowest bound from the min-heap */
+{
+        IndexVisit top, last, *v;
+        int i, child, len;
+
+        v = (IndexVisit *)heap->data;
+        top = v[0];
+        last = v[heap->len - 1];
+        g_array_set_size(heap, heap->len - 1);
+        len = heap->len;
+        for (i = 0; (child = 2 * i + 1) < len; i = child) {
+                if (child + 1 < len && v[child + 1].bound < v[child].bound)
+                        child++;
+                if (v[child].bound >= last.bound)
+                        break;
+                v[i] = v[child];
+        }
+        if (len)
+                v[i] = last;
+        return top;
+}
+
+static void index_search(const Sample *input, TopK *best, int budget)
+/* Visit the nodes in order of the lowest distance any sample under them can
+   have to the input until no closer sample can be found or budget samples
+   have been measured. Distances are rated negative so that the farthest
+   sample found so far is at the top of the heap. */
+{
+        GArray *heap;
+
+        heap = g_array_new(FALSE, FALSE, sizeof (IndexVisit));
+        index_push(heap, 0, 0.f);
+        while (heap->len && budget > 0) {
+                const IndexNode *node;
+                IndexVisit visit;
+                float dist;
+                int i;
+
+                visit = index_pop(heap);
+                if (visit.bound > index_reach(best))
+                        break;
+                node = &g_array_index(index_nodes, IndexNode, visit.node);
+                if (!node->slots) {
+                        float in, out;
+
+                        dist = descriptor_distance(input->descriptor,
+                                                   node->vantage);
+                        in = dist - node->radius;
+                        out = node->radius - dist;
+                        index_push(heap, node->inside,
+                                   in > visit.bound ? in : visit.bound);
+                        index_push(heap, node->outside,
+                                   out > visit.bound ? out : visit.bound);
+                        continue;
+                }
+                for (i = 0; i < (int)node->slots->len; i++) {
+                        int slot = g_array_index(node->slots, int, i);
+
+                        if (!store.enabled[slot] ||
+                            (!ignore_stroke_num &&
+                             store.len[slot] != input->len))
+                                continue;
+                        dist = descriptor_distance(input->descriptor,
+                                                   sample_at(slot)->descriptor);
+                        topk_add(best, slot, -(int)(dist * 256.f));
+                        budget--;
+                }
+        }
+        g_array_free(heap, TRUE);
+}
+
+int sample_index_size(void)
+/* Number of samples in the index */
+{
+        return index_len;
+}
+
+int sample_index_query(const Sample *input, int k, int budget, int *slots)
+/* Find up to k enabled samples whose descriptors are nearest to that of a
+   processed input sample, measuring roughly budget samples at most. Samples
+   with a different number of strokes are skipped unless ignore_stroke_num is
+   set. Returns the number of slots found, nearest first. */
+{
+        TopK best;
+        int len;
+
+        if (!index_nodes || k < 1)
+                return 0;
+        topk_init(&best, k, FALSE);
+        index_search(input, &best, budget);
+        len = topk_sort(&best, slots);
+        topk_cleanup(&best);
+        return len;
+}
+
+/*
+        Sample store
+*/
 
-static SampleLink *samplelink_root = NULL, *samplelink_iter = NULL;
+SampleStore store;
+
+static GHashTable *char_slots = NULL;
+static int sampleiter_slot = 0;
 static int current = 1;
 
-static Sample *sample_new(void)
-/* Allocate a link in the sample linked list */
+static GArray *char_slots_get(gunichar ch, int create)
+/* Get the array of slots that hold samples for a character. Empty slots are
+   filed under the zero character. */
+{
+        GArray *slots;
+
+        if (!char_slots) {
+                if (!create)
+                        return NULL;
+                char_slots = g_hash_table_new(g_direct_hash, g_direct_equal);
+        }
+        slots = g_hash_table_lookup(char_slots, GUINT_TO_POINTER(ch));
+        if (!slots && create) {
+                slots = g_array_new(FALSE, FALSE, sizeof (int));
+                g_hash_table_insert(char_slots, GUINT_TO_POINTER(ch), slots);
+        }
+        return slots;
+}
+
+static void char_slots_remove(gunichar ch, int slot)
+/* Remove a slot from a character's slot array */
+{
+        GArray *slots;
+        int i;
+
+        if (!(slots = char_slots_get(ch, FALSE)))
+                return;
+        for (i = slots->len - 1; i >= 0; i--)
+                if (g_array_index(slots, int, i) == slot) {
+                        g_array_remove_index_fast(slots, i);
+                        return;
+                }
+}
+
+static void store_sync(int slot)
+/* Update the store arrays after the sample in a slot has changed */
 {
-        SampleLink *link;
+        Sample *sample;
 
-        link = g_malloc0(sizeof (*link));
-        link->next = samplelink_root;
-        if (samplelink_root)
-                samplelink_root->prev = link;
-        samplelink_root = link;
-        return &link->sample;
+        sample = sample_at(slot);
+        if (store.ch[slot] != sample->ch) {
+                char_slots_remove(store.ch[slot], slot);
+                g_array_append_val(char_slots_get(sample->ch, TRUE), slot);
+        }
+        store.ch[slot] = sample->ch;
+        store.used[slot] = sample->used;
+        store.len[slot] = sample->len;
+        store.enabled[slot] = sample->enabled;
+        sample_features(store.features + slot, sample);
+        index_update(slot);
+}
+
+static int sample_new(void)
+/* Allocate a slot in the sample store */
+{
+        if (store.slots >= store.size) {
+                int chunks;
+
+                chunks = store.size / SAMPLE_CHUNK + 1;
+                store.size = chunks * SAMPLE_CHUNK;
+                store.chunks = g_renew(Sample *, store.chunks, chunks);
+                store.chunks[chunks - 1] = g_new0(Sample, SAMPLE_CHUNK);
+                store.ch = g_renew(gunichar, store.ch, store.size);
+                store.used = g_renew(int, store.used, store.size);
+                store.len = g_renew(unsigned short, store.len, store.size);
+                store.enabled = g_renew(unsigned char, store.enabled,
+                                        store.size);
+                store.features = g_renew(SampleFeatures, store.features,
+                                         store.size);
+        }
+        store.ch[store.slots] = 0;
+        g_array_append_val(char_slots_get(0, TRUE), store.slots);
+        store_sync(store.slots);
+        return store.slots++;
+}
+
+static int sample_slot(const Sample *sample)
+/* Find the slot of a sample or -1 if it is not in the store */
+{
+        int i;
+
+        for (i = 0; i < store.slots; i += SAMPLE_CHUNK)
+                if (sample >= store.chunks[i / SAMPLE_CHUNK] &&
+                    sample < store.chunks[i / SAMPLE_CHUNK] + SAMPLE_CHUNK)
+                        return i + (sample - store.chunks[i / SAMPLE_CHUNK]);
+        return -1;
 }
 
 void sampleiter_reset(void)
-/* Reset the sample linked list iterator */
+/* Reset the sample store iterator */
 {
-        samplelink_iter = samplelink_root;
+        sampleiter_slot = 0;
 }
 
 Sample *sampleiter_next(void)
-/* Get the next sample link from the sample linked list iterator */
+/* Get the next sample from the sample store iterator */
 {
-        SampleLink *link;
-
-        if (!samplelink_iter)
+        if (sampleiter_slot >= store.slots)
                 return NULL;
-        link = samplelink_iter;
-        samplelink_iter = samplelink_iter->next;
-        return &link->sample;
+        return sample_at(sampleiter_slot++);
 }
 
 int samples_loaded(void)
 {
-        return samplelink_root != NULL;
+        return store.slots > 0;
+}
+
+/*
+        Top-K selection
+*/
+
+static int topk_worse(const TopKEntry *a, const TopKEntry *b)
+/* Returns TRUE if A ranks below B. Equal ratings are ranked by slot so that
+   the selection does not depend on the order entries were added in. */
+{
+        return a->rating < b->rating ||
+               (a->rating == b->rating && a->slot > b->slot);
+}
+
+static int topk_compare(const void *a, const void *b)
+{
+        return topk_worse(a, b) ? 1 : topk_worse(b, a) ? -1 : 0;
+}
+
+static void topk_set(TopK *topk, int i, TopKEntry entry)
+/* Place an entry in the heap, keeping the character map up to date */
+{
+        topk->heap[i] = entry;
+        if (topk->chars)
+                g_hash_table_insert(topk->chars,
+                                    GUINT_TO_POINTER(store.ch[entry.slot]),
+                                    GINT_TO_POINTER(i + 1));
+}
+
+static void topk_sift_up(TopK *topk, int i)
+{
+        TopKEntry entry;
+
+        entry = topk->heap[i];
+        while (i > 0) {
+                int parent = (i - 1) / 2;
+
+                if (!topk_worse(&entry, topk->heap + parent))
+                        break;
+                topk_set(topk, i, topk->heap[parent]);
+                i = parent;
+        }
+        topk_set(topk, i, entry);
+}
+
+static void topk_sift_down(TopK *topk, int i)
+{
+        TopKEntry entry;
+
+        entry = topk->heap[i];
+        for (;;) {
+                int child = 2 * i + 1;
+
+                if (child >= topk->len)
+                        break;
+                if (child + 1 < topk->len &&
+                    topk_worse(topk->heap + child + 1, topk->heap + child))
+                        child++;
+                if (!topk_worse(topk->heap + child, &entry))
+                        break;
+                topk_set(topk, i, topk->heap[child]);
+                i = child;
+        }
+        topk_set(topk, i, entry);
+}
+
+void topk_init(TopK *topk, int size, int by_char)
+{
+        topk->heap = g_new(TopKEntry, size > 0 ? size : 1);
+        topk->chars = by_char ? g_hash_table_new(g_direct_hash,
+                                                 g_direct_equal) : NULL;
+        topk->len = 0;
+        topk->size = size;
+}
+
+void topk_cleanup(TopK *topk)
+{
+        g_free(topk->heap);
+        if (topk->chars)
+                g_hash_table_destroy(topk->chars);
+        topk->heap = NULL;
+        topk->chars = NULL;
+}
+
+void topk_add(TopK *topk, int slot, int rating)
+/* Offer a rated slot to the selection */
+{
+        TopKEntry entry;
+
+        entry.slot = slot;
+        entry.rating = rating;
+
+        /* A character that is already in the heap can only improve */
+        if (topk->chars) {
+                int i;
+
+                i = GPOINTER_TO_INT(g_hash_table_lookup(topk->chars,
+                                    GUINT_TO_POINTER(store.ch[slot]))) - 1;
+                if (i >= 0) {
+                        if (topk_worse(topk->heap + i, &entry)) {
+                                topk->heap[i] = entry;
+                                topk_sift_down(topk, i);
+                        }
+                        return;
+                }
+        }
+
+        /* Fill the heap up first */
+        if (topk->len < topk->size) {
+                topk->heap[topk->len++] = entry;
+                topk_sift_up(topk, topk->len - 1);
+                return;
+        }
+
+        /* Replace the lowest entry */
+        if (topk->len < 1 || !topk_worse(topk->heap, &entry))
+                return;
+        if (topk->chars)
+                g_hash_table_remove(topk->chars,
+                                    GUINT_TO_POINTER(store.ch[topk->heap->slot]));
+        topk->heap[0] = entry;
+        topk_sift_down(topk, 0);
+}
+
+int topk_sort(const TopK *topk, int *slots)
+/* Write out the selected slots, highest rated first, and return how many
+   there are */
+{
+        TopKEntry sorted[topk->len + 1];
+        int i;
+
+        memcpy(sorted, topk->heap, topk->len * sizeof (*sorted));
+        qsort(sorted, topk->len, sizeof (*sorted), topk_compare);
+        for (i = 0; i < topk->len; i++)
+                slots[i] = sorted[i].slot;
+        return topk->len;
+}
+
+/*
+        Result cache
+*/
+
+/* Number of recent recognition results to keep */
+#define RESULT_CACHE_SIZE 16
+
+/* Results are keyed by a hash of the input ink and of the settings that
+   affect recognition, the word context is compared in full. The store
+   generation changes whenever samples are added or removed so that results
+   referring to an older store are never returned. */
+typedef struct {
+        guint64 hash;
+        unsigned int generation;
+        int used, num_alts, strength;
+        gunichar ch;
+        char word[64];
+        Sample **alts;
+        int *ratings;
+} CachedResult;
+
+static CachedResult result_cache[RESULT_CACHE_SIZE];
+static GMutex *result_cache_mutex;
+static unsigned int store_generation = 1;
+static int result_cache_used = 0;
+
+static guint64 hash_bytes(guint64 hash, const void *data, gsize len)
+/* FNV-1a hash */
+{
+        const unsigned char *bytes = data;
+        gsize i;
+
+        for (i = 0; i < len; i++) {
+                hash ^= bytes[i];
+                hash *= G_GUINT64_CONSTANT(1099511628211);
+        }
+        return hash;
+}
+
+static guint64 result_hash(const Sample *sample)
+/* Hash the ink of a sample along with the settings that affect its
+   recognition */
+{
+        UnicodeBlock *block;
+        guint64 hash;
+        int i, j, settings[] = {samples_max, ignore_stroke_dir,
+                                ignore_stroke_num, no_latin_alpha,
+                                wordfreq_enable, prefilter_strokes,
+                                prefilter_vertical, prefilter_size,
+                                prefilter_ink, prefilter_cap, prefilter_index,
+                                average_finalists};
+
+        hash = G_GUINT64_CONSTANT(14695981039346656037);
+        hash = hash_bytes(hash, &sample->len, sizeof (sample->len));
+        for (i = 0; i < sample->len; i++) {
+                const Stroke *stroke = sample->strokes[i];
+
+                hash = hash_bytes(hash, &stroke->len, sizeof (stroke->len));
+                for (j = 0; j < stroke->len; j++) {
+                        hash = hash_bytes(hash, &stroke->points[j].x,
+                                          sizeof (stroke->points[j].x));
+                        hash = hash_bytes(hash, &stroke->points[j].y,
+                                          sizeof (stroke->points[j].y));
+                }
+        }
+        hash = hash_bytes(hash, settings, sizeof (settings));
+        for (i = 0; i < ENGINES; i++)
+                hash = hash_bytes(hash, &engines[i].range,
+                                  sizeof (engines[i].range));
+        for (block = unicode_blocks; block->name; block++)
+                hash = hash_bytes(hash, &block->enabled,
+                                  sizeof (block->enabled));
+        return hash;
+}
+
+static void store_changed(void)
+/* Invalidate cached results after samples were added or removed */
+{
+        g_mutex_lock(result_cache_mutex);
+        store_generation++;
+        g_mutex_unlock(result_cache_mutex);
+}
+
+static unsigned int result_cache_generation(void)
+/* Get the current store generation */
+{
+        unsigned int generation;
+
+        g_mutex_lock(result_cache_mutex);
+        generation = store_generation;
+        g_mutex_unlock(result_cache_mutex);
+        return generation;
+}
+
+static int result_cache_get(RecognizerContext *ctx, guint64 hash,
+                            unsigned int generation, Sample **alts,
+                            int *ratings, int num_alts)
+/* Fill in the alternates from a cached result. Returns FALSE if there is
+   none for this input. */
+{
+        CachedResult *entry = NULL;
+        int i;
+
+        g_mutex_lock(result_cache_mutex);
+        for (i = 0; i < RESULT_CACHE_SIZE; i++)
+                if (result_cache[i].used && result_cache[i].hash == hash &&
+                    result_cache[i].generation == generation &&
+                    result_cache[i].num_alts == num_alts &&
+                    !memcmp(result_cache[i].word, ctx->word,
+                            sizeof (ctx->word))) {
+                        entry = result_cache + i;
+                        break;
+                }
+        if (entry) {
+                entry->used = ++result_cache_used;
+                for (i = 0; i < num_alts; i++) {
+                        alts[i] = entry->alts[i];
+                        ratings[i] = entry->ratings[i];
+                        if (!alts[i])
+                                break;
+                }
+                ctx->input->ch = entry->ch;
+                ctx->strength = entry->strength;
+        }
+        g_mutex_unlock(result_cache_mutex);
+        if (entry)
+                g_message("Recognized -- cached result");
+        return entry != NULL;
+}
+
+static void result_cache_put(const RecognizerContext *ctx, guint64 hash,
+                             unsigned int generation, Sample **alts,
+                             const int *ratings, int num_alts)
+/* Replace the least-recently-used cached result */
+{
+        CachedResult *entry;
+        int i;
+
+        g_mutex_lock(result_cache_mutex);
+        entry = result_cache;
+        for (i = 1; i < RESULT_CACHE_SIZE; i++)
+                if (result_cache[i].used < entry->used)
+                        entry = result_cache + i;
+        entry->hash = hash;
+        entry->generation = generation;
+        entry->used = ++result_cache_used;
+        entry->ch = ctx->input->ch;
+        entry->strength = ctx->strength;
+        memcpy(entry->word, ctx->word, sizeof (entry->word));
+        if (num_alts > entry->num_alts) {
+                entry->alts = g_renew(Sample *, entry->alts, num_alts);
+                entry->ratings = g_renew(int, entry->ratings, num_alts);
+        }
+        entry->num_alts = num_alts;
+        for (i = 0; i < num_alts; i++) {
+                entry->alts[i] = alts[i];
+                entry->ratings[i] = ratings[i];
+                if (!alts[i])
+                        break;
+        }
+        g_mutex_unlock(result_cache_mutex);
 }
 
 /*
@@ -128,7 +826,9 @@ void clear_sample(Sample *sample)
         for (i = 0; i < sample->len; i++) {
                 stroke_free(sample->strokes[i]);
                 stroke_free(sample->roughs[i]);
+                stroke_free(sample->fines[i]);
         }
+        g_free(sample->gluable);
         memset(sample, 0, sizeof (*sample));
 }
 
@@ -141,92 +841,156 @@ void copy_sample(Sample *dest, const Sample *src)
         for (i = 0; i < src->len; i++) {
                 dest->strokes[i] = stroke_clone(src->strokes[i], FALSE);
                 dest->roughs[i] = stroke_clone(src->roughs[i], FALSE);
+                dest->fines[i] = NULL;
         }
+        if (src->gluable)
+                dest->gluable = g_memdup(src->gluable,
+                                         2 * src->len * src->len);
 }
 
-static void process_gluable(const Sample *sample, int stroke_num)
-/* Calculates the lowest distance between the start or end of one stroke and any
-   other point on each other stroke in the sample */
+static unsigned char stroke_gluable(Point point, const Stroke *stroke)
+/* Find the lowest distance from a point to any point on a stroke. The
+   distance is truncated to a gluable value, so it is computed in floating
+   point exactly as it always was to keep strokes near the limit gluable. */
+{
+        Vec2 v;
+        float dist, min = GLUE_DIST;
+        int j, dx, dy;
+
+        /* Strokes whose bounding box is out of reach cannot be glued. The
+           margin keeps rounding error below from making a difference. */
+        dx = point.x < stroke->min_x ? stroke->min_x - point.x :
+             point.x > stroke->max_x ? point.x - stroke->max_x : 0;
+        dy = point.y < stroke->min_y ? stroke->min_y - point.y :
+             point.y > stroke->max_y ? point.y - stroke->max_y : 0;
+        if (dx * dx + dy * dy >= (GLUE_DIST + 1) * (GLUE_DIST + 1))
+                return GLUABLE_MAX;
+
+        /* Check the distance to the first point */
+        vec2_set(&v, stroke->points[0].x - point.x,
+                 stroke->points[0].y - point.y);
+        dist = vec2_mag(&v);
+        if (dist < min)
+                min = dist;
+
+        for (j = 0; j < stroke->len - 1; j++) {
+                Vec2 l, w;
+                double dist, mag, dot;
+
+                /* Vector l is a unit vector from point j + 1 to j. Segments
+                   of zero length would not be, so they are skipped. */
+                vec2_set(&l, stroke->points[j].x - stroke->points[j + 1].x,
+                         stroke->points[j].y - stroke->points[j + 1].y);
+                if (!l.x && !l.y)
+                        continue;
+                mag = vec2_norm(&l, &l);
+
+                /* Vector w is a vector from our point to point j */
+                vec2_set(&w, stroke->points[j].x - point.x,
+                         stroke->points[j].y - point.y);
+
+                /* For points that are not in between a segment, get the
+                   distance from the points themselves, otherwise get the
+                   distance from the segment line */
+                dot = vec2_dot(&l, &w);
+                if (dot < 0. || dot > mag) {
+                        vec2_set(&v, stroke->points[j + 1].x - point.x,
+                                 stroke->points[j + 1].y - point.y);
+                        dist = vec2_mag(&v);
+                } else {
+                        dist = vec2_cross(&w, &l);
+                        if (dist < 0)
+                                dist = -dist;
+                }
+                if (dist < min)
+                        min = dist;
+        }
+        return min * GLUABLE_MAX / GLUE_DIST;
+}
+
+static void process_gluable(Sample *sample, int stroke_num)
+/* Calculates the lowest distance between the start or end of one stroke and
+   any other point on each other stroke in the sample */
 {
-        Point point;
         Stroke *s1;
-        int i, start;
+        int i, end;
 
-        /* Dots cannot be glued */
         s1 = sample->strokes[stroke_num];
-        memset(s1->gluable_start, -1, sizeof (s1->gluable_start));
-        memset(s1->gluable_end, -1, sizeof (s1->gluable_end));
-        if (s1->spread < DOT_SPREAD)
-                return;
+        for (end = 0; end < 2; end++) {
+                unsigned char *row;
+                Point point;
 
-        start = TRUE;
-scan:
-        point = start ? s1->points[0] : s1->points[s1->len - 1];
-        for (i = 0; i < sample->len; i++) {
-                Vec2 v;
-                Stroke *s2;
-                float dist, min = GLUE_DIST;
-                int j;
-                char gluable;
+                row = sample->gluable + (end * sample->len + stroke_num) *
+                                        sample->len;
+                memset(row, GLUABLE_MAX, sample->len);
 
-                s2 = sample->strokes[i];
-                if (i == stroke_num || s2->spread < DOT_SPREAD)
+                /* Dots cannot be glued */
+                if (s1->spread < DOT_SPREAD)
                         continue;
 
-                /* Check the distance to the first point */
-                vec2_set(&v, s2->points[0].x - point.x,
-                         s2->points[0].y - point.y);
-                dist = vec2_mag(&v);
-                if (dist < min)
-                        min = dist;
+                point = end ? s1->points[s1->len - 1] : s1->points[0];
+                for (i = 0; i < sample->len; i++) {
+                        Stroke *s2 = sample->strokes[i];
 
-                /* Find the lowest distance from the glue point to any other
-                   point on the other stroke */
-                for (j = 0; j < s2->len - 1; j++) {
-        	        Vec2 l, w;
-        		double dist, mag, dot;
-
-                        /* Vector l is a unit vector from point j to j + 1 */
-        		vec2_set(&l, s2->points[j].x - s2->points[j + 1].x,
-        		         s2->points[j].y - s2->points[j + 1].y);
-                        mag = vec2_norm(&l, &l);
-
-        		/* Vector w is a vector from point j to our point */
-        		vec2_set(&w, s2->points[j].x - point.x,
-        		         s2->points[j].y - point.y);
-
-        		/* For points that are not in between a segment,
-        		   get the distance from the points themselves,
-        		   otherwise get the distance from the segment line */
-        		dot = vec2_dot(&l, &w);
-        		if (dot < 0. || dot > mag) {
-        		        vec2_set(&v, s2->points[j + 1].x - point.x,
-        		                 s2->points[j + 1].y - point.y);
-        		        dist = vec2_mag(&v);
-		        } else {
-                		dist = vec2_cross(&w, &l);
-                		if (dist < 0)
-                		        dist = -dist;
-		        }
-                        if (dist < min)
-                                min = dist;
+                        if (i != stroke_num && s2->spread >= DOT_SPREAD)
+                                row[i] = stroke_gluable(point, s2);
+                }
+        }
+}
+
+static void process_descriptor(Sample *sample)
+/* Spread the rough-sampled points of a sample over a grid centered on the
+   sample center. Each point is split between the four nearest cells. */
+{
+        float grid[DESCRIPTOR_GRID * DESCRIPTOR_GRID], cell, total = 0.f;
+        int i, j, value;
+
+        memset(grid, 0, sizeof (grid));
+        cell = (float)SCALE / DESCRIPTOR_GRID;
+        for (i = 0; i < sample->len; i++) {
+                const Stroke *rough = sample->roughs[i];
+
+                for (j = 0; j < rough->len; j++) {
+                        float x, y, fx, fy;
+                        int x0, y0, dx, dy;
+
+                        x = (rough->points[j].x - sample->center.x) / cell +
+                            DESCRIPTOR_GRID / 2 - 0.5f;
+                        y = (rough->points[j].y - sample->center.y) / cell +
+                            DESCRIPTOR_GRID / 2 - 0.5f;
+                        x0 = floorf(x);
+                        y0 = floorf(y);
+                        fx = x - x0;
+                        fy = y - y0;
+                        for (dy = 0; dy < 2; dy++)
+                                for (dx = 0; dx < 2; dx++) {
+                                        int gx = x0 + dx, gy = y0 + dy;
+
+                                        if (gx < 0 || gx >= DESCRIPTOR_GRID ||
+                                            gy < 0 || gy >= DESCRIPTOR_GRID)
+                                                continue;
+                                        grid[gy * DESCRIPTOR_GRID + gx] +=
+                                                (dx ? fx : 1.f - fx) *
+                                                (dy ? fy : 1.f - fy);
+                                }
+                        total++;
                 }
-                gluable = min * GLUABLE_MAX / GLUE_DIST;
-                if (start)
-                        s1->gluable_start[i] = gluable;
-                else
-                        s1->gluable_end[i] = gluable;
         }
-        if (start) {
-                start = FALSE;
-                goto scan;
+
+        /* Cells hold their share of the ink. A difference of one stroke
+           counts as much as a thirty-second of the ink moving. */
+        for (i = 0; i < DESCRIPTOR_GRID * DESCRIPTOR_GRID; i++) {
+                value = total > 0.f ? grid[i] * 2048.f / total + 0.5f : 0;
+                sample->descriptor[i] = value > 255 ? 255 : value;
         }
+        value = sample->len * 64;
+        sample->descriptor[i] = value > 255 ? 255 : value;
 }
 
 void process_sample(Sample *sample)
 /* Generate cached properties of a sample */
 {
-        int i;
+        int i, min_x = 0, max_x = 0, min_y = 0, max_y = 0;
         float distance;
 
         if (sample->processed)
@@ -234,8 +998,24 @@ void process_sample(Sample *sample)
         sample->processed = TRUE;
 
         /* Make sure all strokes have been processed first */
-        for (i = 0; i < sample->len; i++)
-                process_stroke(sample->strokes[i]);
+        for (i = 0; i < sample->len; i++) {
+                Stroke *stroke = sample->strokes[i];
+
+                process_stroke(stroke);
+
+                /* Compute the bounding box */
+                if (!i || stroke->min_x < min_x)
+                        min_x = stroke->min_x;
+                if (!i || stroke->max_x > max_x)
+                        max_x = stroke->max_x;
+                if (!i || stroke->min_y < min_y)
+                        min_y = stroke->min_y;
+                if (!i || stroke->max_y > max_y)
+                        max_y = stroke->max_y;
+        }
+        sample->width = max_x - min_x;
+        sample->height = max_y - min_y;
+        sample->gluable = g_malloc(2 * sample->len * sample->len);
 
         /* Compute properties for each stroke */
         vec2_set(&sample->center, 0., 0.);
@@ -267,6 +1047,39 @@ void process_sample(Sample *sample)
         }
         vec2_scale(&sample->center, &sample->center, 1.f / distance);
         sample->distance = distance;
+        process_descriptor(sample);
+}
+
+void sample_features(SampleFeatures *features, const Sample *sample)
+/* Copy the prefilter features of a processed sample */
+{
+        features->center_y = sample->center.y;
+        features->distance = sample->distance;
+        features->width = sample->width;
+        features->height = sample->height;
+}
+
+Stroke *sample_fine(Sample *sample, int i)
+/* Get a stroke of a processed sample sampled at its fine resolution. The
+   stroke is created on first use and kept until the sample is cleared. This
+   can be called from several recognition threads at once. */
+{
+        Stroke *fine;
+        int points;
+
+        fine = g_atomic_pointer_get((volatile gpointer *)&sample->fines[i]);
+        if (fine)
+                return fine;
+        points = fine_points(sample->strokes[i]);
+        fine = sample_stroke(NULL, sample->strokes[i], points, points);
+        if (!g_atomic_pointer_compare_and_exchange((volatile gpointer *)
+                                                   &sample->fines[i],
+                                                   NULL, fine)) {
+                stroke_free(fine);
+                fine = g_atomic_pointer_get((volatile gpointer *)
+                                            &sample->fines[i]);
+        }
+        return fine;
 }
 
 void center_samples(Vec2 *ac_to_bc, Sample *a, Sample *b)
@@ -284,17 +1097,17 @@ int char_disabled(gunichar ch)
                !g_unichar_isgraph(ch);
 }
 
-int sample_disqualified(const Sample *sample)
+int sample_disqualified(const RecognizerContext *ctx, int slot)
 /* Check disqualification conditions for a sample during recognition.
    The preprocessor engine must run before any calls to this or
    disqualification will not work. */
 {
-        if ((!ignore_stroke_num && sample->len != input->len) ||
-            !sample->enabled)
+        if ((!ignore_stroke_num && store.len[slot] != ctx->input->len) ||
+            !store.enabled[slot])
                 return 1;
-        if (sample->disqualified)
+        if (ctx->disqualified[slot])
                 return 2;
-        if (char_disabled(sample->ch))
+        if (char_disabled(store.ch[slot]))
                 return 3;
         return 0;
 }
@@ -307,63 +1120,75 @@ int sample_valid(const Sample *sample, int used)
         return sample->used == used;
 }
 
-static void sample_rating(Sample *sample)
+static void sample_rating(RecognizerContext *ctx, int slot)
 /* Get the composite processed rating on a sample */
 {
         int i, rating;
 
-        if (!sample->ch || sample_disqualified(sample) ||
-            sample->penalty >= 1.f) {
-                sample->rating = RATING_MIN;
+        if (!store.ch[slot] || sample_disqualified(ctx, slot) ||
+            ctx->penalty[slot] >= 1.f) {
+                ctx->rating[slot] = RATING_MIN;
                 return;
         }
         for (i = 0, rating = 0; i < ENGINES; i++)
-                rating += engine_rating(sample, i);
-        rating *= 1.f - sample->penalty;
+                rating += engine_rating(ctx, slot, i);
+        rating *= 1.f - ctx->penalty[slot];
         if (rating > RATING_MAX)
                 rating = RATING_MAX;
         if (rating < RATING_MIN)
                 rating = RATING_MIN;
-        sample->rating = rating;
+        ctx->rating[slot] = rating;
 }
 
 void update_enabled_samples(void)
 /* Run through the samples list and enable samples in enabled blocks */
 {
-        Sample *sample;
+        int i;
 
-        sampleiter_reset();
-        while ((sample = sampleiter_next())) {
+        recognize_cancel();
+        for (i = 0; i < store.slots; i++) {
                 UnicodeBlock *block;
 
-                sample->enabled = FALSE;
-                if (!sample->ch)
-                        continue;
-                block = unicode_blocks;
-                while (block->name) {
-                        if (sample->ch >= block->start &&
-                            sample->ch <= block->end) {
-                                sample->enabled = block->enabled;
-                                break;
+                store.enabled[i] = FALSE;
+                if (store.ch[i]) {
+                        block = unicode_blocks;
+                        while (block->name) {
+                                if (store.ch[i] >= block->start &&
+                                    store.ch[i] <= block->end) {
+                                        store.enabled[i] = block->enabled;
+                                        break;
+                                }
+                                block++;
                         }
-                        block++;
                 }
+                sample_at(i)->enabled = store.enabled[i];
         }
 }
 
 void promote_sample(Sample *sample)
 /* Update usage counter for a sample */
 {
+        int slot;
+
+        recognize_cancel();
         sample->used = current++;
+        if ((slot = sample_slot(sample)) >= 0)
+                store_sync(slot);
 }
 
 void demote_sample(Sample *sample)
 /* Remove the sample from our set if we can */
 {
+        int slot;
+
+        recognize_cancel();
+        store_changed();
         if (char_trained(sample->ch) > 1)
                 clear_sample(sample);
         else
                 sample->used = 1;
+        if ((slot = sample_slot(sample)) >= 0)
+                store_sync(slot);
 }
 
 Stroke *transform_stroke(Sample *src, Transform *tfm, int i)
@@ -372,6 +1197,7 @@ Stroke *transform_stroke(Sample *src, Transform *tfm, int i)
         Stroke *stroke;
         int k, j;
 
+        counter_add(COUNTER_TRANSFORMS, 1);
         stroke = stroke_new(0);
         for (k = 0, j = 0; k < STROKES_MAX && j < src->len; k++)
                 for (j = 0; j < src->len; j++)
@@ -388,205 +1214,695 @@ Stroke *transform_stroke(Sample *src, Transform *tfm, int i)
         Recognition and training
 */
 
-Sample *input = NULL;
 int strength_sum = 0;
 
-static GTimer *timer;
+static GPtrArray *main_contexts;
 
-void recognize_init(void)
+RecognizerContext *recognizer_context_new(void)
 {
-#ifndef DISABLE_WORDFREQ
-        load_wordfreq();
-#endif
-        timer = g_timer_new();
+        RecognizerContext *ctx;
+
+        ctx = g_new0(RecognizerContext, 1);
+        ctx->timer = g_timer_new();
+        return ctx;
 }
 
-void recognize_sample(Sample *sample, Sample **alts, int num_alts)
+void recognizer_context_free(RecognizerContext *ctx)
 {
-        gulong microsec;
-        int i, range, strength, msec;
+        if (!ctx)
+                return;
+        g_free(ctx->rating);
+        g_free(ctx->ratings);
+        g_free(ctx->disqualified);
+        g_free(ctx->penalty);
+        g_free(ctx->transforms);
+        g_timer_destroy(ctx->timer);
+        g_free(ctx);
+}
 
-        g_timer_start(timer);
-        input = sample;
-        process_sample(input);
+static void context_reserve(RecognizerContext *ctx)
+/* Make room for the candidate scores of every sample in the store */
+{
+        if (ctx->size >= store.slots)
+                return;
+        ctx->size = store.size;
+        ctx->rating = g_renew(short, ctx->rating, ctx->size);
+        ctx->ratings = g_realloc(ctx->ratings,
+                                 ctx->size * sizeof (*ctx->ratings));
+        ctx->disqualified = g_renew(unsigned char, ctx->disqualified,
+                                    ctx->size);
+        ctx->penalty = g_renew(float, ctx->penalty, ctx->size);
+        ctx->transforms = g_renew(Transform, ctx->transforms, ctx->size);
+}
 
-        /* Clear ratings */
-        sampleiter_reset();
-        while ((sample = sampleiter_next())) {
-                memset(sample->ratings, 0, sizeof (sample->ratings));
-                sample->rating = 0;
-        }
+/*
+        Operation counters
+*/
 
-        /* Run engines */
-        for (i = 0, range = 0; i < ENGINES; i++) {
-                int rated = 0;
+/* Operations are counted into the counters bound to the current thread,
+   the engine workers bind counters of their own for every range so that
+   counting needs no locks. Nothing is counted outside of recognition. */
+static GStaticPrivate counters_key = G_STATIC_PRIVATE_INIT;
+static GMutex *counters_mutex = NULL;
+static Counters counters_last, counters_total;
+
+static const char *counter_names[COUNTERS] = {
+        "stroke transforms", "glue attempts", "stroke measures",
+        "table cells", "stroke samplings", "stroke allocations",
+        "bytes allocated",
+};
 
-                if (engines[i].func)
-                        engines[i].func();
+static const char *pruned_names[PREFILTERS] = {
+        "not indexed near", "strokes", "vertical", "size", "ink", "over cap",
+};
 
-                /* Compute average and maximum value */
-                engines[i].max = 0;
-                engines[i].average = 0;
-                sampleiter_reset();
-                while ((sample = sampleiter_next())) {
-                        int value = 0;
+Counters *counters_current(void)
+/* Get the counters bound to the current thread, if any */
+{
+        return g_static_private_get(&counters_key);
+}
 
-                        if (!sample->ch)
-                                continue;
-                        if (sample->ratings[i] > value)
-                                value = sample->ratings[i];
-                        if (!value && engines[i].ignore_zeros)
-                                continue;
-                        if (value > engines[i].max)
-                                engines[i].max = value;
-                        engines[i].average += value;
-                        rated++;
-                }
-                if (!rated)
-                        continue;
-                engines[i].average /= rated;
-                if (engines[i].max > 0)
-                        range += engines[i].range;
-                if (engines[i].max == engines[i].average) {
-                        engines[i].average = 0;
-                        continue;
-                }
-                engines[i].max -= engines[i].average;
-        }
-        if (!range) {
-                g_timer_elapsed(timer, &microsec);
-                msec = microsec / 100;
-                g_message("Recognized -- No ratings, %dms", msec);
-                input->ch = 0;
+static void counters_bind(Counters *counters)
+{
+        g_static_private_set(&counters_key, counters, NULL);
+}
+
+static void counters_merge(Counters *dest, const Counters *src)
+{
+        int i;
+
+        for (i = 0; i < COUNTERS; i++)
+                dest->ops[i] += src->ops[i];
+        for (i = 0; i < PREFILTERS; i++)
+                dest->pruned[i] += src->pruned[i];
+}
+
+void counter_add(int counter, int n)
+/* Count operations on the current thread */
+{
+        Counters *counters;
+
+        if ((counters = counters_current()))
+                counters->ops[counter] += n;
+}
+
+static void counters_record(const Counters *counters)
+/* Keep the counters of a finished recognition and add them to the totals */
+{
+        if (counters_mutex)
+                g_mutex_lock(counters_mutex);
+        counters_last = *counters;
+        counters_merge(&counters_total, counters);
+        if (counters_mutex)
+                g_mutex_unlock(counters_mutex);
+}
+
+void recognize_counters(Counters *last, Counters *total)
+/* Get the counters of the last recognition and the totals of every
+   recognition so far, either may be NULL */
+{
+        if (counters_mutex)
+                g_mutex_lock(counters_mutex);
+        if (last)
+                *last = counters_last;
+        if (total)
+                *total = counters_total;
+        if (counters_mutex)
+                g_mutex_unlock(counters_mutex);
+}
+
+void counters_dump(const Counters *counters, const char *title)
+/* Print out counters at the debug log level */
+{
+        GString *str;
+        int i;
+
+        if (log_level < G_LOG_LEVEL_DEBUG)
+                return;
+        str = g_string_new(NULL);
+        for (i = 0; i < COUNTERS; i++)
+                g_string_append_printf(str, "%s%" G_GUINT64_FORMAT " %s",
+                                       i ? ", " : "", counters->ops[i],
+                                       counter_names[i]);
+        g_debug("%s operations -- %s", title, str->str);
+        g_string_truncate(str, 0);
+        for (i = 0; i < PREFILTERS; i++)
+                g_string_append_printf(str, "%s%" G_GUINT64_FORMAT " %s",
+                                       i ? ", " : "", counters->pruned[i],
+                                       pruned_names[i]);
+        g_debug("%s prefiltered -- %s", title, str->str);
+        g_string_free(str, TRUE);
+}
+
+void recognize_counters_dump(void)
+/* Print out the totals of every recognition so far */
+{
+        Counters total;
+
+        recognize_counters(NULL, &total);
+        counters_dump(&total, "Session");
+}
+
+/*
+        Engine workers
+*/
+
+static GThreadPool *engine_pool = NULL;
+static GMutex *engine_mutex;
+static GCond *engine_cond;
+static int engine_threads = 1;
+
+static void engine_worker(EngineRange *range)
+{
+        counters_bind(range->counters);
+        range->func(range);
+        counters_bind(NULL);
+        g_mutex_lock(engine_mutex);
+        if (g_atomic_int_dec_and_test(range->pending))
+                g_cond_broadcast(engine_cond);
+        g_mutex_unlock(engine_mutex);
+}
+
+static void engine_init(void)
+/* Start one worker for every processor after the first */
+{
+        long cpus;
+
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cpus > ENGINE_THREADS_MAX)
+                cpus = ENGINE_THREADS_MAX;
+        if (cpus < 2 || !g_thread_supported())
+                return;
+        engine_mutex = g_mutex_new();
+        engine_cond = g_cond_new();
+        engine_pool = g_thread_pool_new((GFunc)engine_worker, NULL, cpus - 1,
+                                        FALSE, NULL);
+        if (!engine_pool) {
+                g_warning("Failed to start recognition threads");
                 return;
         }
+        engine_threads = cpus;
+        g_debug("Recognizing with %d threads", engine_threads);
+}
 
-        /* Rank the top samples */
-        alts[0] = NULL;
-        sampleiter_reset();
-        while ((sample = sampleiter_next())) {
-                int j;
+int engine_split(EngineRange *ranges, RecognizerContext **ctxs, int ctxs_len,
+                 int len, int min_len)
+/* Divide len items into as many ranges of at least min_len items as there
+   are threads. Returns the number of ranges. */
+{
+        int i, n;
+
+        n = len / (min_len > 0 ? min_len : 1);
+        if (n > engine_threads)
+                n = engine_threads;
+        if (n < 1)
+                n = 1;
+        for (i = 0; i < n; i++) {
+                ranges[i].ctxs = ctxs;
+                ranges[i].ctxs_len = ctxs_len;
+                ranges[i].items = NULL;
+                ranges[i].best = NULL;
+                ranges[i].data = NULL;
+                ranges[i].split = n;
+                ranges[i].start = len * i / n;
+                ranges[i].end = len * (i + 1) / n;
+        }
+        return n;
+}
 
-                sample_rating(sample);
-                if (sample->rating < 1)
-                        continue;
+void engine_count(EngineRange *range, int k)
+/* Count the following operations of a range for the context k */
+{
+        counters_bind(range->counters + k);
+}
 
-                /* Bubble-sort the new rating in */
-                for (j = 0; j < num_alts; j++)
-                        if (!alts[j]) {
-                                if (j < num_alts - 1)
-                                        alts[j + 1] = NULL;
-                                break;
-                        } else if (alts[j]->ch == sample->ch) {
-                                if (alts[j]->rating >= sample->rating)
-                                        j = num_alts;
-                                break;
-                        } else if (alts[j]->rating < sample->rating) {
-                                int k;
+void engine_run(EngineRange *ranges, int n, EngineRangeFunc func)
+/* Run the function on every range and wait for all of them to finish. The
+   first range is run on the calling thread. Each range counts operations
+   for every context on its own, they are added to the contexts afterwards.
+   A pass without contexts adds them to the counters of the calling
+   thread. */
+{
+        Counters *outer, *counters, stack[ENGINE_THREADS_MAX];
+        volatile gint pending = n - 1;
+        int i, k, ctxs_len;
+
+        outer = counters_current();
+        ctxs_len = ranges[0].ctxs_len > 0 ? ranges[0].ctxs_len : 1;
+        counters = stack;
+        if (n * ctxs_len > ENGINE_THREADS_MAX)
+                counters = g_new(Counters, n * ctxs_len);
+        memset(counters, 0, n * ctxs_len * sizeof (*counters));
+        for (i = 0; i < n; i++) {
+                ranges[i].func = func;
+                ranges[i].pending = &pending;
+                ranges[i].counters = counters + i * ctxs_len;
+        }
+        for (i = 1; i < n; i++)
+                g_thread_pool_push(engine_pool, ranges + i, NULL);
+        counters_bind(ranges[0].counters);
+        func(ranges);
+        counters_bind(outer);
+        if (n > 1) {
+                g_mutex_lock(engine_mutex);
+                while (g_atomic_int_get(&pending) > 0)
+                        g_cond_wait(engine_cond, engine_mutex);
+                g_mutex_unlock(engine_mutex);
+        }
+        for (i = 0; i < n; i++)
+                for (k = 0; k < ctxs_len; k++) {
+                        Counters *dest;
+
+                        dest = ranges[0].ctxs_len > 0 ?
+                               &ranges[0].ctxs[k]->counters : outer;
+                        if (dest)
+                                counters_merge(dest, counters +
+                                                     i * ctxs_len + k);
+                }
+        if (counters != stack)
+                g_free(counters);
+}
 
-                                if (j == num_alts - 1)
-                                        break;
+void recognize_init(void)
+{
+#ifndef DISABLE_WORDFREQ
+        load_wordfreq();
+#endif
+        engine_init();
+        if (g_thread_supported()) {
+                result_cache_mutex = g_mutex_new();
+                counters_mutex = g_mutex_new();
+        }
+        main_contexts = g_ptr_array_new();
+}
 
-                                /* See if the character is in the list */
-                                for (k = j + 1; k < num_alts - 1 && alts[k] &&
-                                     alts[k]->ch != sample->ch; k++);
+static int engine_stats(RecognizerContext *ctx, int i)
+/* Compute the average and maximum value of an engine's ratings. Returns the
+   range the engine contributes to the composite rating. */
+{
+        EngineStats *stats = ctx->engines + i;
+        int j, range, rated = 0;
 
-                                /* Do not swallow zeroes */
-                                if (!alts[k] && k < num_alts - 1)
-                                        alts[k + 1] = NULL;
+        stats->max = 0;
+        stats->average = 0;
+        for (j = 0; j < store.slots; j++) {
+                int value = 0;
 
-                                memmove(alts + j + 1, alts + j,
-                                        sizeof (*alts) * (k - j));
-                                break;
-                        }
-                if (j >= num_alts)
+                if (!store.ch[j])
                         continue;
-                alts[j] = sample;
+                if (ctx->ratings[j][i] > value)
+                        value = ctx->ratings[j][i];
+                if (!value && engines[i].ignore_zeros)
+                        continue;
+                if (value > stats->max)
+                        stats->max = value;
+                stats->average += value;
+                rated++;
+        }
+        if (!rated)
+                return 0;
+        stats->average /= rated;
+        range = stats->max > 0 ? engines[i].range : 0;
+        if (stats->max == stats->average)
+                stats->average = 0;
+        else
+                stats->max -= stats->average;
+        return range;
+}
+
+static void recognize_rank(RecognizerContext *ctx, Sample **alts,
+                           int *ratings, int num_alts, int msec)
+/* Pick the alternates once all engines have run */
+{
+        TopK best;
+        Sample *sample = ctx->input;
+        int i, ranked[num_alts], ranked_len;
+
+        counters_record(&ctx->counters);
+        if (!ctx->range) {
+                g_message("Recognized -- No ratings, %dms", msec);
+                if (num_alts > 0)
+                        alts[0] = NULL;
+                sample->ch = 0;
+                return;
         }
 
+        /* Rank the top samples, keeping only the best sample for each
+           character */
+        topk_init(&best, num_alts, TRUE);
+        for (i = 0; i < store.slots; i++) {
+                sample_rating(ctx, i);
+                if (ctx->rating[i] >= 1)
+                        topk_add(&best, i, ctx->rating[i]);
+        }
+        ranked_len = topk_sort(&best, ranked);
+        topk_cleanup(&best);
+
         /* Normalize the alternates' accuracies to 100 */
-        if (range)
-                for (i = 0; i < num_alts && alts[i]; i++)
-                        alts[i]->rating = alts[i]->rating * 100 / range;
+        for (i = 0; i < ranked_len; i++) {
+                alts[i] = sample_at(ranked[i]);
+                ratings[i] = ctx->rating[ranked[i]] * 100 / ctx->range;
+        }
+        if (i < num_alts)
+                alts[i] = NULL;
 
         /* Keep track of strength stat */
-        strength = 0;
-        if (alts[0]) {
-                strength = alts[1] ? alts[0]->rating - alts[1]->rating :
-                                        100;
-                strength_sum += strength;
-        }
+        if (alts[0])
+                ctx->strength = alts[1] ? ratings[0] - ratings[1] : 100;
 
-        g_timer_elapsed(timer, &microsec);
-        msec = microsec / 100;
         g_message("Recognized -- %d/%d (%d%%) disqualified, "
                   "%dms (%dms/symbol), %d%% strong",
-                  num_disqualified, prep_examined,
-                  num_disqualified * 100 / prep_examined, msec,
-                  prep_examined - num_disqualified ?
-                  msec / (prep_examined - num_disqualified) : -1,
-                  strength);
+                  ctx->num_disqualified, ctx->prep_examined,
+                  ctx->num_disqualified * 100 / ctx->prep_examined, msec,
+                  ctx->prep_examined - ctx->num_disqualified ?
+                  msec / (ctx->prep_examined - ctx->num_disqualified) : -1,
+                  ctx->strength);
+        counters_dump(&ctx->counters, "Recognition");
 
         /*  Print out the top candidate scores in detail */
         if (log_level >= G_LOG_LEVEL_DEBUG)
                 for (i = 0; i < num_alts && alts[i]; i++) {
+                        const Transform *tfm = ctx->transforms + ranked[i];
                         int j, len;
 
-                        len = input->len >= alts[i]->len ? input->len :
-                                                           alts[i]->len;
+                        len = sample->len >= alts[i]->len ? sample->len :
+                                                            alts[i]->len;
                         log_print("| '%C' (", alts[i]->ch);
                         for (j = 0; j < ENGINES; j++)
                                 log_print("%4d [%5d]%s",
-                                        engine_rating(alts[i], j),
-                                        alts[i]->ratings[j],
+                                        engine_rating(ctx, ranked[i], j),
+                                        ctx->ratings[ranked[i]][j],
                                         j < ENGINES - 1 ? "," : "");
-                        log_print(") %3d%% [", alts[i]->rating);
+                        log_print(") %3d%% [", ratings[i]);
                         for (j = 0; j < len; j++)
-                                log_print("%d",
-                                          alts[i]->transform.order[j] - 1);
+                                log_print("%d", tfm->order[j] - 1);
                         for (j = 0; j < len; j++)
-                                log_print("%c", alts[i]->transform.reverse[j] ?
-                                                'R' : '-');
+                                log_print("%c", tfm->reverse[j] ? 'R' : '-');
                         for (j = 0; j < len; j++)
-                                log_print("%d", alts[i]->transform.glue[j]);
+                                log_print("%d", tfm->glue[j]);
                         log_print("]\n");
                 }
 
         /* Select the top result */
-        input->ch = alts[0] ? alts[0]->ch : 0;
+        sample->ch = alts[0] ? alts[0]->ch : 0;
 }
 
-static void insert_sample(const Sample *new_sample, int force_overwrite)
-/* Insert a sample into the sample chain, possibly overwriting an older
-   sample */
+static int recognize_run(RecognizerContext **ctxs, int len, Sample **alts,
+                         int *ratings, int num_alts)
+/* Run the engines on processed inputs. Returns FALSE if the batch was
+   cancelled. */
 {
-        int last_used, count = 0;
-        Sample *sample, *overwrite = NULL, *create = NULL;
+        gulong microsec;
+        int i, k;
+
+        g_timer_start(ctxs[0]->timer);
+        for (k = 0; k < len; k++) {
+                RecognizerContext *ctx = ctxs[k];
+
+                /* Clear ratings */
+                context_reserve(ctx);
+                memset(ctx->ratings, 0, store.slots * sizeof (*ctx->ratings));
+                memset(ctx->rating, 0, store.slots * sizeof (*ctx->rating));
+                memset(&ctx->counters, 0, sizeof (ctx->counters));
+                ctx->prep_examined = 0;
+                ctx->num_disqualified = 0;
+                ctx->strength = 0;
+                ctx->range = 0;
+                for (i = 0; i < ENGINES; i++)
+                        ctx->engines[i].scale = engines[i].scale;
+        }
 
-        last_used = force_overwrite ? current + 1 : new_sample->used;
-        sampleiter_reset();
-        while ((sample = sampleiter_next())) {
-                if (!sample->used) {
-                        create = sample;
-                        continue;
+        /* Run engines */
+        for (i = 0; i < ENGINES; i++) {
+                if (engines[i].func)
+                        engines[i].func(ctxs, len);
+                if (g_atomic_int_get(&ctxs[0]->cancelled)) {
+                        for (k = 0; k < len && num_alts > 0; k++)
+                                alts[k * num_alts] = NULL;
+                        return FALSE;
                 }
-                if (sample->ch != new_sample->ch)
+                for (k = 0; k < len; k++)
+                        ctxs[k]->range += engine_stats(ctxs[k], i);
+        }
+
+        g_timer_elapsed(ctxs[0]->timer, &microsec);
+        for (k = 0; k < len; k++)
+                recognize_rank(ctxs[k], alts + k * num_alts,
+                               ratings + k * num_alts, num_alts,
+                               microsec / 100 / len);
+        return TRUE;
+}
+
+void recognize_batch(RecognizerContext **ctxs, Sample **samples, int len,
+                     Sample **alts, int *ratings, int num_alts)
+/* Recognize several samples in one pass over the sample store, one context
+   per sample. The alternates and ratings of sample k start at
+   k * num_alts. Only the contexts are written to so several batches can
+   run at once as long as the sample store is not modified. Samples that
+   were recognized recently are answered from the result cache. */
+{
+        RecognizerContext *missed[len];
+        Sample **run_alts;
+        guint64 hashes[len];
+        unsigned int generation;
+        int i, k, misses, miss[len], *run_ratings, done;
+
+        if (len < 1)
+                return;
+        generation = result_cache_generation();
+        for (k = 0, misses = 0; k < len; k++) {
+                ctxs[k]->input = samples[k];
+                process_sample(samples[k]);
+                hashes[k] = result_hash(samples[k]);
+                if (result_cache_get(ctxs[k], hashes[k], generation,
+                                     alts + k * num_alts,
+                                     ratings + k * num_alts, num_alts))
                         continue;
-                if (sample->used < last_used) {
-                        overwrite = sample;
-                        last_used = sample->used;
+                missed[misses] = ctxs[k];
+                miss[misses++] = k;
+        }
+        if (!misses)
+                return;
+
+        /* If only some of the samples were cached, recognize the rest into
+           separate buffers */
+        run_alts = alts;
+        run_ratings = ratings;
+        if (misses < len) {
+                run_alts = g_new0(Sample *, misses * num_alts);
+                run_ratings = g_new0(int, misses * num_alts);
+        }
+        done = recognize_run(missed, misses, run_alts, run_ratings, num_alts) &&
+               !g_atomic_int_get(&ctxs[0]->cancelled);
+        for (k = 0; k < misses; k++) {
+                i = miss[k];
+                if (run_alts != alts) {
+                        memcpy(alts + i * num_alts, run_alts + k * num_alts,
+                               num_alts * sizeof (*alts));
+                        memcpy(ratings + i * num_alts,
+                               run_ratings + k * num_alts,
+                               num_alts * sizeof (*ratings));
                 }
-                count++;
+                if (done)
+                        result_cache_put(ctxs[i], hashes[i], generation,
+                                         alts + i * num_alts,
+                                         ratings + i * num_alts, num_alts);
         }
-        if (overwrite && count >= samples_max) {
-                sample = overwrite;
-                clear_sample(sample);
-        } else if (create)
-                sample = create;
+        if (run_alts != alts) {
+                g_free(run_alts);
+                g_free(run_ratings);
+        }
+
+        /* The batch is cancelled through its first context even if that
+           sample was cached */
+        if (!done)
+                for (k = 0; k < len && num_alts > 0; k++)
+                        alts[k * num_alts] = NULL;
+}
+
+void recognize_context(RecognizerContext *ctx, Sample *sample, Sample **alts,
+                       int *ratings, int num_alts)
+/* Recognize a single sample */
+{
+        recognize_batch(&ctx, &sample, 1, alts, ratings, num_alts);
+}
+
+void recognize_samples(Sample **samples, const char **words, int len,
+                       Sample **alts, int *ratings, int num_alts)
+/* Recognize several samples at once, for instance when re-recognizing a row
+   of cells. The word context of each sample is given as a buffer in the
+   format of cell_widget_word(), words may be NULL if there is none. */
+{
+        RecognizerContext **ctxs;
+        int k;
+
+        while ((int)main_contexts->len < len)
+                g_ptr_array_add(main_contexts, recognizer_context_new());
+        ctxs = (RecognizerContext **)main_contexts->pdata;
+        for (k = 0; k < len; k++)
+                if (words && words[k])
+                        memcpy(ctxs[k]->word, words[k], sizeof (ctxs[k]->word));
+                else
+                        memset(ctxs[k]->word, 0, sizeof (ctxs[k]->word));
+        recognize_batch(ctxs, samples, len, alts, ratings, num_alts);
+}
+
+void recognize_sample(Sample *sample, Sample **alts, int *ratings,
+                      int num_alts)
+/* Recognize a sample in the current word context */
+{
+        const char *word;
+
+        word = cell_widget_word();
+        recognize_samples(&sample, &word, 1, alts, ratings, num_alts);
+        strength_sum += ((RecognizerContext *)main_contexts->pdata[0])->
+                        strength;
+}
+
+/*
+        Speculative recognition
+*/
+
+/* A copy of the input is recognized in the background as soon as a stroke
+   ends so that the result is ready by the time the cell is finished. The
+   store must not change while this runs so anything that modifies it
+   cancels the speculation first. */
+static struct {
+        GThread *thread;
+        RecognizerContext *ctx;
+        Sample sample, **alts;
+        const Sample *input;
+        int *ratings, num_alts, len;
+} speculation;
+
+static gpointer speculation_thread(gpointer data)
+{
+        recognize_context(speculation.ctx, &speculation.sample,
+                          speculation.alts, speculation.ratings,
+                          speculation.num_alts);
+        return NULL;
+}
+
+static void speculation_join(void)
+{
+        if (!speculation.thread)
+                return;
+        g_thread_join(speculation.thread);
+        speculation.thread = NULL;
+}
+
+void recognize_cancel(void)
+/* Stop and discard the speculative recognition */
+{
+        if (speculation.thread)
+                g_atomic_int_set(&speculation.ctx->cancelled, TRUE);
+        speculation_join();
+        clear_sample(&speculation.sample);
+        speculation.input = NULL;
+}
+
+void recognize_speculate(const Sample *sample, const char *word, int num_alts)
+/* Start recognizing a sample in the background. Word is the word context
+   as returned by cell_widget_word(). */
+{
+        recognize_cancel();
+        if (!g_thread_supported() || sample->len < 1 || num_alts < 1)
+                return;
+        if (!speculation.ctx)
+                speculation.ctx = recognizer_context_new();
+        memcpy(speculation.ctx->word, word, sizeof (speculation.ctx->word));
+        g_atomic_int_set(&speculation.ctx->cancelled, FALSE);
+        if (num_alts > speculation.num_alts) {
+                speculation.alts = g_renew(Sample *, speculation.alts,
+                                           num_alts);
+                speculation.ratings = g_renew(int, speculation.ratings,
+                                              num_alts);
+        }
+        speculation.num_alts = num_alts;
+        copy_sample(&speculation.sample, sample);
+        speculation.input = sample;
+        speculation.len = sample->len;
+        speculation.thread = g_thread_create(speculation_thread, NULL, TRUE,
+                                             NULL);
+        if (!speculation.thread)
+                recognize_cancel();
+}
+
+int recognize_speculated(Sample *sample, const char *word, Sample **alts,
+                         int *ratings, int num_alts)
+/* Collect the result of the speculative recognition, waiting for it if
+   necessary. Returns FALSE if the speculation was not started on this
+   sample, word context and number of alternates, in which case the sample
+   must be recognized normally. */
+{
+        int i, valid;
+
+        speculation_join();
+        valid = speculation.input && speculation.input == sample &&
+                speculation.len == sample->len &&
+                speculation.num_alts == num_alts &&
+                !memcmp(speculation.ctx->word, word,
+                        sizeof (speculation.ctx->word));
+        if (valid) {
+                process_sample(sample);
+                for (i = 0; i < num_alts; i++) {
+                        alts[i] = speculation.alts[i];
+                        ratings[i] = speculation.ratings[i];
+                        if (!alts[i])
+                                break;
+                }
+                sample->ch = speculation.sample.ch;
+                strength_sum += speculation.ctx->strength;
+        }
+        recognize_cancel();
+        return valid;
+}
+
+static void insert_sample(const Sample *new_sample, int force_overwrite)
+/* Insert a sample into the sample store, possibly overwriting an older
+   sample */
+{
+        GArray *slots;
+        Sample *sample;
+        int i, last_used, count = 0, overwrite = -1, create = -1;
+
+        recognize_cancel();
+        store_changed();
+
+        /* Find the least-recently-used sample for this character */
+        last_used = force_overwrite ? current + 1 : new_sample->used;
+        if ((slots = char_slots_get(new_sample->ch, FALSE)))
+                for (i = 0; i < (int)slots->len; i++) {
+                        int slot = g_array_index(slots, int, i);
+
+                        if (!store.used[slot])
+                                continue;
+                        if (store.used[slot] < last_used ||
+                            (store.used[slot] == last_used &&
+                             slot < overwrite)) {
+                                overwrite = slot;
+                                last_used = store.used[slot];
+                        }
+                        count++;
+                }
+
+        /* Find the first empty slot */
+        if ((slots = char_slots_get(0, FALSE)))
+                for (i = 0; i < (int)slots->len; i++)
+                        if (create < 0 || g_array_index(slots, int, i) < create)
+                                create = g_array_index(slots, int, i);
+
+        if (overwrite >= 0 && count >= samples_max) {
+                i = overwrite;
+                clear_sample(sample_at(i));
+        } else if (create >= 0)
+                i = create;
         else
-                sample = sample_new();
+                i = sample_new();
+        sample = sample_at(i);
         *sample = *new_sample;
         process_sample(sample);
+        store_sync(i);
 }
 
 void train_sample(const Sample *sample, int trusted)
@@ -610,27 +1926,27 @@ void train_sample(const Sample *sample, int trusted)
 int char_trained(gunichar ch)
 /* Count the number of samples for this character */
 {
-        Sample *sample;
-        int count = 0;
+        GArray *slots;
 
-        sampleiter_reset();
-        while ((sample = sampleiter_next())) {
-                if (sample->ch != ch)
-                        continue;
-                count++;
-        }
-        return count;
+        slots = char_slots_get(ch, FALSE);
+        return slots ? slots->len : 0;
 }
 
 void untrain_char(gunichar ch)
 /* Delete all samples for a character */
 {
-        Sample *sample;
+        GArray *slots;
 
-        sampleiter_reset();
-        while ((sample = sampleiter_next()))
-                if (sample->ch == ch)
-                        clear_sample(sample);
+        if (!ch)
+                return;
+        recognize_cancel();
+        store_changed();
+        while ((slots = char_slots_get(ch, FALSE)) && slots->len) {
+                int slot = g_array_index(slots, int, slots->len - 1);
+
+                clear_sample(sample_at(slot));
+                store_sync(slot);
+        }
 }
 
 /*
@@ -650,6 +1966,16 @@ void recognize_sync(void)
         profile_sync_int(&no_latin_alpha);
         for (i = 0; i < ENGINES; i++)
                 profile_sync_int(&engines[i].range);
+
+        /* Settings added after the engine ranges so that older profiles
+           still read correctly */
+        profile_sync_int(&prefilter_strokes);
+        profile_sync_int(&prefilter_vertical);
+        profile_sync_int(&prefilter_size);
+        profile_sync_int(&prefilter_ink);
+        profile_sync_int(&prefilter_cap);
+        profile_sync_int(&prefilter_index);
+        profile_sync_int(&average_finalists);
         profile_write("\n");
 }
 
@@ -727,10 +2053,9 @@ static void sample_write(Sample *sample)
 void samples_write(void)
 /* Write all of the samples to the profile */
 {
-        Sample *sample;
+        int i;
 
-        sampleiter_reset();
-        while ((sample = sampleiter_next()))
-                if (sample->ch && sample->used)
-                        sample_write(sample);
+        for (i = 0; i < store.slots; i++)
+                if (store.ch[i] && store.used[i])
+                        sample_write(sample_at(i));
 }
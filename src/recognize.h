@@ -46,8 +46,7 @@ typedef struct {
         Vec2 center;
         float distance;
         int len, size, spread;
-        unsigned char processed,
-                      gluable_start[STROKES_MAX], gluable_end[STROKES_MAX];
+        unsigned char processed;
         signed char min_x, max_x, min_y, max_y;
         Point points[];
 } Stroke;
@@ -56,6 +55,7 @@ typedef struct {
 Stroke *stroke_new(int size);
 Stroke *stroke_clone(const Stroke *src, int reverse);
 void stroke_free(Stroke *stroke);
+void copy_stroke(Stroke **dest, const Stroke *src, int reverse);
 void clear_stroke(Stroke *stroke);
 
 /* Stroke manipulation */
@@ -64,7 +64,7 @@ void draw_stroke(Stroke **stroke, int x, int y);
 void smooth_stroke(Stroke *s);
 void simplify_stroke(Stroke *s);
 Stroke *sample_stroke(Stroke *out, Stroke *in, int points, int size);
-void sample_strokes(Stroke *a, Stroke *b, Stroke **as, Stroke **bs);
+int fine_points(const Stroke *stroke);
 void glue_stroke(Stroke **a, const Stroke *b, int reverse);
 void dump_stroke(Stroke *stroke);
 
@@ -97,28 +97,46 @@ enum {
         ENGINES
 };
 
+typedef struct Cell Cell;
+typedef struct RecognizerContext RecognizerContext;
+
 typedef struct {
         const char *name;
-        void (*func)(void);
-        int range, ignore_zeros, scale, average, max;
+        void (*func)(RecognizerContext **ctxs, int len);
+        int range, ignore_zeros, scale;
 } Engine;
 
-typedef struct Cell Cell;
-
 /* Generalized measure function */
 typedef float (*MeasureFunc)(Stroke *a, int i, Stroke *b, int j, void *extra);
 
+/* Returned by measure_strokes() when the measure was abandoned */
+#define MEASURE_ABANDONED G_MAXFLOAT
+
+/* Stages of the preprocessor's prefilter cascade in the order they are
+   applied */
+enum {
+        PREFILTER_INDEX,
+        PREFILTER_STROKES,
+        PREFILTER_VERTICAL,
+        PREFILTER_SIZE,
+        PREFILTER_INK,
+        PREFILTER_CAP,
+        PREFILTERS
+};
+
 extern int ignore_stroke_order, ignore_stroke_dir, ignore_stroke_num,
-           elasticity, no_latin_alpha, wordfreq_enable;
+           elasticity, no_latin_alpha, wordfreq_enable, prefilter_strokes,
+           prefilter_vertical, prefilter_size, prefilter_ink, prefilter_cap,
+           prefilter_index, average_finalists;
 extern Engine engines[ENGINES];
 
-void engine_average(void);
-void engine_wordfreq(void);
+void engine_average(RecognizerContext **ctxs, int len);
+void engine_wordfreq(RecognizerContext **ctxs, int len);
 void load_wordfreq(void);
 float measure_distance(const Stroke *a, int i, const Stroke *b, int j,
                        const Vec2 *offset);
 float measure_strokes(Stroke *a, Stroke *b, MeasureFunc func,
-                      void *extra, int points, int elasticity);
+                      void *extra, int points, int elasticity, float limit);
 
 /*
         Samples and characters
@@ -139,6 +157,11 @@ float measure_strokes(Stroke *a, Stroke *b, MeasureFunc func,
 #define ROUGH_RESOLUTION 24.f
 #define ROUGH_ELASTICITY 0
 
+/* Descriptors used by the nearest-neighbor index are a coarse grid of where
+   the ink lies around the sample center followed by the stroke count */
+#define DESCRIPTOR_GRID 8
+#define DESCRIPTOR_LEN (DESCRIPTOR_GRID * DESCRIPTOR_GRID + 1)
+
 typedef struct {
         unsigned char valid, order[STROKES_MAX], reverse[STROKES_MAX],
                       glue[STROKES_MAX];
@@ -149,32 +172,207 @@ typedef struct {
         int used;
         gunichar ch;
         unsigned short len;
-        short rating, ratings[ENGINES];
-        unsigned char enabled, disqualified, processed;
-        Transform transform;
+        unsigned char enabled, processed, width, height,
+                      descriptor[DESCRIPTOR_LEN];
         Vec2 center;
-        float distance, penalty;
-        Stroke *strokes[STROKES_MAX], *roughs[STROKES_MAX];
+        float distance;
+        Stroke *strokes[STROKES_MAX], *roughs[STROKES_MAX],
+               *fines[STROKES_MAX];
+        unsigned char *gluable;
 } Sample;
 
-extern Sample *input;
-extern int num_disqualified, training_block, samples_max;
+static inline unsigned char sample_gluable(const Sample *sample, int a, int b,
+                                           int end)
+/* How close the start or end of stroke A comes to stroke B, scaled so that
+   GLUABLE_MAX means the strokes cannot be glued there */
+{
+        return sample->gluable[(end * sample->len + a) * sample->len + b];
+}
+
+extern int training_block, samples_max;
+
+/*
+        Sample store
+*/
+
+/* Number of samples allocated at a time. Samples never move once allocated
+   because cells keep pointers to their alternates. */
+#define SAMPLE_CHUNK 256
+
+/* Cheap properties of a processed sample used to rule it out before the
+   expensive engines run */
+typedef struct {
+        float center_y, distance;
+        unsigned char width, height;
+} SampleFeatures;
+
+/* Samples are kept in chunked arrays. The fields that are read on every
+   pass over the store are mirrored in parallel arrays indexed by sample slot
+   so that these passes do not have to touch the Sample structures
+   themselves. The store is only read during recognition. */
+typedef struct {
+        Sample **chunks;
+        gunichar *ch;
+        int *used;
+        unsigned short *len;
+        unsigned char *enabled;
+        SampleFeatures *features;
+        int slots, size;
+} SampleStore;
+
+extern SampleStore store;
+
+static inline Sample *sample_at(int slot)
+/* Get the sample stored in a slot */
+{
+        return store.chunks[slot / SAMPLE_CHUNK] + slot % SAMPLE_CHUNK;
+}
 
 /* Sample list iteration */
 void sampleiter_reset(void);
 Sample *sampleiter_next(void);
 
+/* Nearest-neighbor index over the stored samples */
+int sample_index_size(void);
+int sample_index_query(const Sample *input, int k, int budget, int *slots);
+
+/*
+        Top-K selection
+*/
+
+typedef struct {
+        int slot, rating;
+} TopKEntry;
+
+/* Keeps the highest rated slots in a min-heap. If chars is set, only the
+   best slot for each character is kept. */
+typedef struct {
+        TopKEntry *heap;
+        GHashTable *chars;
+        int len, size;
+} TopK;
+
+void topk_init(TopK *topk, int size, int by_char);
+void topk_cleanup(TopK *topk);
+void topk_add(TopK *topk, int slot, int rating);
+int topk_sort(const TopK *topk, int *slots);
+
+/*
+        Operation counters
+*/
+
+/* Operations counted on the recognition hot paths */
+enum {
+        COUNTER_TRANSFORMS,
+        COUNTER_GLUES,
+        COUNTER_MEASURES,
+        COUNTER_CELLS,
+        COUNTER_SAMPLINGS,
+        COUNTER_ALLOCS,
+        COUNTER_BYTES,
+        COUNTERS
+};
+
+/* Operation counts of a recognition along with the number of samples each
+   prefilter stage ruled out */
+typedef struct {
+        guint64 ops[COUNTERS], pruned[PREFILTERS];
+} Counters;
+
+Counters *counters_current(void);
+void counter_add(int counter, int n);
+void recognize_counters(Counters *last, Counters *total);
+void recognize_counters_dump(void);
+void counters_dump(const Counters *counters, const char *title);
+
+/*
+        Recognition context
+*/
+
+typedef struct {
+        int scale, average, max;
+} EngineStats;
+
+/* Everything a single recognition reads or writes apart from the read-only
+   sample store. Candidate scores are indexed by store slot. */
+struct RecognizerContext {
+        Sample *input;
+        EngineStats engines[ENGINES];
+        Counters counters;
+        int prep_examined, num_disqualified, strength, range, size;
+        char word[64];
+        short *rating, (*ratings)[ENGINES];
+        unsigned char *disqualified;
+        float *penalty;
+        Transform *transforms;
+        GTimer *timer;
+        volatile gint cancelled;
+};
+
+RecognizerContext *recognizer_context_new(void);
+void recognizer_context_free(RecognizerContext *ctx);
+
+/*
+        Engine workers
+*/
+
+/* Engines can split their pass over the store into ranges that run on a
+   pool of worker threads. A range only writes to its own fields and to the
+   context entries of the slots it covers. The per-context fields are
+   arrays with an entry for every context in the batch. Split is the number
+   of ranges the pass was divided into. A pass that was not split runs on
+   the calling thread alone and may run another pass from inside its
+   range. Operations are counted for the first context of the batch unless
+   the range says otherwise with engine_count(). */
+#define ENGINE_THREADS_MAX 16
+
+typedef struct EngineRange EngineRange;
+typedef void (*EngineRangeFunc)(EngineRange *range);
+
+struct EngineRange {
+        RecognizerContext **ctxs;
+        EngineRangeFunc func;
+        const int *items;
+        TopK *best;
+        Counters *counters;
+        void *data;
+        int ctxs_len, start, end, split;
+        volatile gint *pending;
+};
+
+/* A batch is cancelled through its first context, engines should check this
+   regularly and give up early */
+#define ENGINE_CANCELLED(r) g_atomic_int_get(&(r)->ctxs[0]->cancelled)
+
+int engine_split(EngineRange *ranges, RecognizerContext **ctxs, int ctxs_len,
+                 int len, int min_len);
+void engine_run(EngineRange *ranges, int n, EngineRangeFunc func);
+void engine_count(EngineRange *range, int k);
+
 /* Properties */
 void process_sample(Sample *sample);
+void sample_features(SampleFeatures *features, const Sample *sample);
+Stroke *sample_fine(Sample *sample, int i);
 void center_samples(Vec2 *ac_to_bc, Sample *a, Sample *b);
-int sample_disqualified(const Sample *sample);
+int sample_disqualified(const RecognizerContext *ctx, int slot);
 int sample_valid(const Sample *sample, int used);
 int char_trained(gunichar ch);
 int char_disabled(gunichar ch);
 
 /* Processing */
 void clear_sample(Sample *sample);
-void recognize_sample(Sample *cell, Sample **alts, int num_alts);
+void recognize_batch(RecognizerContext **ctxs, Sample **samples, int len,
+                     Sample **alts, int *ratings, int num_alts);
+void recognize_context(RecognizerContext *ctx, Sample *sample, Sample **alts,
+                       int *ratings, int num_alts);
+void recognize_samples(Sample **samples, const char **words, int len,
+                       Sample **alts, int *ratings, int num_alts);
+void recognize_sample(Sample *sample, Sample **alts, int *ratings,
+                      int num_alts);
+void recognize_speculate(const Sample *sample, const char *word, int num_alts);
+int recognize_speculated(Sample *sample, const char *word, Sample **alts,
+                         int *ratings, int num_alts);
+void recognize_cancel(void);
 void train_sample(const Sample *cell, int trusted);
 void untrain_char(gunichar ch);
 void update_enabled_samples(void);
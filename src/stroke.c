@@ -41,6 +41,15 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 /* Size of a stroke structure */
 #define STROKE_SIZE(size) (sizeof (Stroke) + (size) * sizeof (Point))
 
+static void count_alloc(Counters *counters, int size)
+/* Count a stroke allocation of size points */
+{
+        if (!counters)
+                return;
+        counters->ops[COUNTER_ALLOCS]++;
+        counters->ops[COUNTER_BYTES] += STROKE_SIZE(size);
+}
+
 void process_stroke(Stroke *stroke)
 /* Generate cached parameters of a stroke */
 {
@@ -117,6 +126,7 @@ Stroke *stroke_new(int size)
         if (size < POINTS_GRAN)
                 size = POINTS_GRAN;
         stroke = g_malloc(STROKE_SIZE(size));
+        count_alloc(counters_current(), size);
         stroke->size = size;
         clear_stroke(stroke);
         return stroke;
@@ -157,6 +167,28 @@ void stroke_free(Stroke *stroke)
         g_free(stroke);
 }
 
+void copy_stroke(Stroke **pdest, const Stroke *src, int reverse)
+/* Copy a stroke over an existing one, growing it if necessary */
+{
+        Stroke *dest;
+        int size;
+
+        dest = *pdest;
+        size = dest ? dest->size : 0;
+        if (size < src->len) {
+                size = src->len;
+                dest = g_realloc(dest, STROKE_SIZE(size));
+                count_alloc(counters_current(), size);
+        }
+        memcpy(dest, src, sizeof (Stroke));
+        dest->size = size;
+        if (!reverse)
+                memcpy(dest->points, src->points, src->len * sizeof (Point));
+        else
+                reverse_copy_points(dest->points, src->points, src->len);
+        *pdest = dest;
+}
+
 void glue_stroke(Stroke **pa, const Stroke *b, int reverse)
 /* Glue B onto the end of A preserving processed properties */
 {
@@ -179,6 +211,7 @@ void glue_stroke(Stroke **pa, const Stroke *b, int reverse)
         if (a->size < a->len + b->len) {
                 a->size = a->len + b->len;
                 a = g_realloc(a, STROKE_SIZE(a->size));
+                count_alloc(counters_current(), a->size);
         }
 
         /* Gluing two strokes creates a new segment between them */
@@ -348,6 +381,7 @@ Stroke *sample_stroke(Stroke *out, Stroke *in, int points, int size)
 /* Recreate the stroke by sampling at regular distance intervals.
    Sampled strokes always have angle data. */
 {
+        Counters *counters;
         Vec2 v;
         double dist_i, dist_j, dist_per;
         int i, j, len;
@@ -372,8 +406,13 @@ Stroke *sample_stroke(Stroke *out, Stroke *in, int points, int size)
                 points = 1;
 
         /* Allocate memory and copy cached data */
-        if (!out)
+        counters = counters_current();
+        if (counters)
+                counters->ops[COUNTER_SAMPLINGS]++;
+        if (!out) {
                 out = g_malloc(STROKE_SIZE(size));
+                count_alloc(counters, size);
+        }
         out->size = size;
         len = out->size < points ? out->size - 1 : points - 1;
         out->len = len + 1;
@@ -426,20 +465,16 @@ finish:
         return out;
 }
 
-void sample_strokes(Stroke *a, Stroke *b, Stroke **as, Stroke **bs)
-/* Sample multiple strokes to equal lengths */
+int fine_points(const Stroke *stroke)
+/* Number of points a stroke is sampled at for fine comparisons. Two strokes
+   are compared at the length of the longer one. */
 {
         double dist;
         int points;
 
-        /* Find the sample length */
-        dist = a->distance;
-        if (b->distance > dist)
-                dist = b->distance;
+        dist = stroke->distance;
         points = 1 + dist / FINE_RESOLUTION;
         if (points > POINTS_MAX)
                 points = POINTS_MAX;
-
-        *as = sample_stroke(NULL, a, points, points);
-        *bs = sample_stroke(NULL, b, points, points);
+        return points;
 }
@@ -26,9 +26,6 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <stdlib.h>
 #include <string.h>
 
-/* cellwidget.c */
-const char *cell_widget_word(void);
-
 /*
         Word frequency engine
 */
@@ -136,15 +133,14 @@ void load_wordfreq(void)
         return;
 }
 
-void engine_wordfreq(void)
+static void wordfreq_context(RecognizerContext *ctx)
 {
-        Sample *sample;
         const char *pre, *post;
         int i, pre_len, post_len, chars[128];
 
         if (!wordfreq_enable)
                 return;
-        pre = cell_widget_word();
+        pre = ctx->word;
         pre_len = strlen(pre);
         post = pre + pre_len + 1;
         post_len = strlen(post);
@@ -192,10 +188,17 @@ void engine_wordfreq(void)
 
 apply_table:
         /* Apply characters table */
-        sampleiter_reset();
-        while ((sample = sampleiter_next()))
-                if (sample->ch >= 32 && sample->ch < 127)
-                        sample->ratings[ENGINE_WORDFREQ] = chars[sample->ch];
+        for (i = 0; i < store.slots; i++)
+                if (store.ch[i] >= 32 && store.ch[i] < 127)
+                        ctx->ratings[i][ENGINE_WORDFREQ] = chars[store.ch[i]];
+}
+
+void engine_wordfreq(RecognizerContext **ctxs, int len)
+{
+        int k;
+
+        for (k = 0; k < len; k++)
+                wordfreq_context(ctxs[k]);
 }
 
 #endif /* DISABLE_WORDFREQ */
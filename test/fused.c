@@ -0,0 +1,129 @@
+
+/*
+
+cellwriter -- a character recognition input method
+Copyright (C) 2007 Michael Levin <risujin@risujin.org>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+/* Randomized differential test of the fused stroke measure against the
+   distance and angle tables filled out on their own. Limits are picked
+   around the distance measure so that it is abandoned about half of the
+   time, near the row it could first be abandoned at. Usage: fused
+   [trials] */
+
+#include "averages.c"
+#include "recognizer.h"
+
+static void stroke_random(Stroke *stroke, int len)
+/* Make up a wandering stroke with random point angles */
+{
+        int i, x = 0, y = 0;
+
+        stroke->len = len;
+        for (i = 0; i < len; i++) {
+                x += test_random(41) - 20;
+                y += test_random(41) - 20;
+                stroke->points[i].x = x;
+                stroke->points[i].y = y;
+                stroke->points[i].angle = test_random(2 * ANGLE_PI) -
+                                          ANGLE_PI;
+        }
+}
+
+static int same_float(float a, float b)
+{
+        return !memcmp(&a, &b, sizeof (a));
+}
+
+int main(int argc, char **argv)
+{
+#if ANGLE_SIZE < 4
+        Stroke *a, *b;
+        int trials, t, mismatches = 0, abandoned = 0;
+
+        trials = argc > 1 ? atoi(argv[1]) : 100000;
+        test_init();
+        a = stroke_new(POINTS_MAX);
+        b = stroke_new(POINTS_MAX);
+        for (t = 0; t < trials; t++) {
+                Vec2 offset;
+                float limit, dist, angle, row_dist, row_angle, full_dist;
+                int points, elasticity, cells = 0, row_cells = 0,
+                    angle_cells = 0, full_cells = 0;
+
+                /* Mostly short strokes, every tenth one up to the largest */
+                points = 2 + test_random(t % 10 ? 60 : POINTS_MAX - 2);
+                elasticity = test_random(FINE_ELASTICITY + 1);
+                stroke_random(a, points);
+                stroke_random(b, points);
+                vec2_set(&offset, test_random(61) - 30, test_random(61) - 30);
+
+                /* No limit, or one near the measure */
+                full_dist = measure_table(a, b, (MeasureFunc)measure_distance,
+                                          &offset, points, elasticity,
+                                          MEASURE_ABANDONED, &full_cells);
+                limit = t % 3 ? full_dist * (test_random(101) + 50) / 100 :
+                                MEASURE_ABANDONED;
+
+                row_dist = measure_table(a, b, (MeasureFunc)measure_distance,
+                                         &offset, points, elasticity, limit,
+                                         &row_cells);
+                row_angle = measure_angles(a, b, points - 1, elasticity,
+                                           &angle_cells);
+                abandoned += row_dist == MEASURE_ABANDONED;
+
+                /* Both tables together */
+                measure_both(a, b, &offset, points, elasticity, limit, TRUE,
+                             &dist, &angle, &cells);
+                if (!same_float(dist, row_dist) ||
+                    !same_float(angle, row_angle) ||
+                    cells != row_cells + angle_cells) {
+                        if (mismatches++ < 5)
+                                g_print("trial %d: %d points, elasticity %d, "
+                                        "limit %g: distance %g, rows %g, "
+                                        "angle %g, rows %g, cells %d, rows "
+                                        "%d\n", t, points, elasticity, limit,
+                                        dist, row_dist, angle, row_angle,
+                                        cells, row_cells + angle_cells);
+                        continue;
+                }
+
+                /* The angle table alone */
+                cells = 0;
+                measure_both(a, b, &offset, points, elasticity, limit, FALSE,
+                             &dist, &angle, &cells);
+                if (dist != MEASURE_ABANDONED ||
+                    !same_float(angle, row_angle) || cells != angle_cells) {
+                        if (mismatches++ < 5)
+                                g_print("trial %d: %d points, elasticity %d, "
+                                        "angle alone %g, rows %g, cells %d, "
+                                        "rows %d\n", t, points, elasticity,
+                                        angle, row_angle, cells,
+                                        angle_cells);
+                }
+        }
+        stroke_free(a);
+        stroke_free(b);
+        g_print("%d mismatches in %d measures, %d abandoned\n", mismatches,
+                trials, abandoned);
+        return mismatches > 0;
+#else
+        g_print("Not built, angles are not measured on integer tables\n");
+        return 0;
+#endif
+}
@@ -0,0 +1,274 @@
+
+/*
+
+cellwriter -- a character recognition input method
+Copyright (C) 2007 Michael Levin <risujin@risujin.org>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+/* Differential test of greedy mapping against a reference that builds
+   every candidate stroke with transform_stroke(), the way greedy mapping
+   originally did. Samples are mapped onto samples of the same characters
+   with strokes split, reversed and reordered, so that strokes are glued
+   and gluing fails often. Half of the mappings are of characters with
+   enough strokes to measure candidates on the worker pool, which is only
+   started with more than one processor. Usage: greedy [trials] */
+
+#include "preprocess.c"
+#include "recognizer.h"
+
+/* Number of strokes that could not be glued on in the reference */
+static int glue_failures;
+
+static float reference_map(Sample *larger, Sample *smaller, Transform *ptfm,
+                           Vec2 *offset, float *ppenalty, int stale)
+/* Greedy mapping that measures candidates built from the transform. If
+   STALE is set, strokes that could not be glued on are left tagged in the
+   transform as they originally were. */
+{
+        Transform tfm;
+        Stroke *buffer;
+        int i, unmapped_len;
+        float total;
+
+        unmapped_len = larger->len;
+        buffer = stroke_new(POINTS_MAX);
+        memset(&tfm, 0, sizeof (tfm));
+        *ptfm = tfm;
+        tfm.valid = TRUE;
+
+        for (i = 0, total = 0.f; i < smaller->len; i++) {
+                float best, best_reach = G_MAXFLOAT, best_value = G_MAXFLOAT,
+                      value, penalty = G_MAXFLOAT, seg_dist = 0.f;
+                int j, last_j = 0, best_j = 0, glue = 0;
+
+        glue_more:
+                for (j = 0, best = G_MAXFLOAT; j < larger->len; j++) {
+                        Stroke *stroke;
+                        float reach, scale;
+                        unsigned char gluable;
+
+                        if (tfm.order[j])
+                                continue;
+                        tfm.reverse[j] = FALSE;
+                        if (map_oversize(larger, smaller, i, j, seg_dist))
+                                continue;
+                        tfm.order[j] = i + 1;
+                        tfm.glue[j] = glue;
+
+                measure:
+                        reach = 0.f;
+                        gluable = 0;
+                        if (glue && !map_glue(larger, &tfm, last_j, j,
+                                              tfm.reverse[j], &gluable,
+                                              &reach)) {
+                                if (tfm.reverse[j] || !ignore_stroke_dir)
+                                        goto failed;
+                                tfm.reverse[j] = TRUE;
+                                if (!map_glue(larger, &tfm, last_j, j, TRUE,
+                                              &gluable, &reach))
+                                        goto failed;
+                        }
+
+                        /* Build the candidate from scratch */
+                        stroke = transform_stroke(larger, &tfm, i);
+                        scale = smaller->distance /
+                                (reach + ptfm->reach + larger->distance);
+                        value = measure_partial(smaller->roughs[i], stroke,
+                                                offset, scale, buffer,
+                                                MEASURE_ABANDONED);
+                        stroke_free(stroke);
+
+                        if (value < best && value < VALUE_MAX) {
+                                best = value;
+                                best_j = j;
+                                best_reach = reach;
+                                *ptfm = tfm;
+                                penalty = glue * GLUE_PENALTY +
+                                          gluable * GLUABLE_PENALTY /
+                                                    GLUABLE_MAX;
+                        }
+                        if (value < VALUE_MIN)
+                                break;
+                        if (ignore_stroke_dir && !tfm.reverse[j] &&
+                            larger->strokes[j]->spread > DOT_SPREAD) {
+                                tfm.reverse[j] = TRUE;
+                                goto measure;
+                        }
+                        tfm.reverse[j] = FALSE;
+                        tfm.order[j] = 0;
+                        continue;
+
+                failed:
+                        glue_failures++;
+                        if (stale)
+                                continue;
+                        tfm.reverse[j] = FALSE;
+                        tfm.order[j] = 0;
+                }
+                if (best < G_MAXFLOAT) {
+                        best_value = best;
+                        *ppenalty += penalty;
+                        seg_dist += best_reach +
+                                    larger->strokes[best_j]->distance;
+                        ptfm->reach += best_reach;
+                        tfm = *ptfm;
+                        unmapped_len--;
+                        if (unmapped_len >= smaller->len - i &&
+                            larger->strokes[best_j]->spread > DOT_SPREAD) {
+                                last_j = best_j;
+                                glue++;
+                                goto glue_more;
+                        }
+                } else if (!glue) {
+                        ptfm->valid = FALSE;
+                        stroke_free(buffer);
+                        return G_MAXFLOAT;
+                }
+                total += best_value;
+        }
+        stroke_free(buffer);
+        if (unmapped_len) {
+                ptfm->valid = FALSE;
+                return G_MAXFLOAT;
+        }
+        return total / smaller->len;
+}
+
+static int same_mapping(const Transform *a, float a_dist, float a_penalty,
+                        const Transform *b, float b_dist, float b_penalty,
+                        int len)
+/* Check if two mappings came out exactly the same */
+{
+        int j;
+
+        if (a->valid != b->valid || memcmp(&a_dist, &b_dist, sizeof (float)))
+                return FALSE;
+        if (!a->valid)
+                return TRUE;
+        if (memcmp(&a_penalty, &b_penalty, sizeof (float)))
+                return FALSE;
+        for (j = 0; j < len; j++)
+                if (a->order[j] != b->order[j] ||
+                    (a->order[j] && (a->reverse[j] != b->reverse[j] ||
+                                     a->glue[j] != b->glue[j])))
+                        return FALSE;
+        return TRUE;
+}
+
+static void proto_split(Proto *dest, const Proto *src)
+/* Make a character out of another one with some of its strokes split in
+   two, reversed or swapped */
+{
+        int i, j;
+
+        dest->len = 0;
+        for (i = 0; i < src->len && dest->len < PROTO_STROKES_MAX - 1; i++) {
+                int split, reverse, n = src->points[i];
+
+                split = n >= 10 && test_random(2) ? n / 2 : n;
+                reverse = test_random(4) == 0;
+                for (j = 0; j < n; j++) {
+                        int k = dest->len + (j >= split), m, from;
+
+                        m = j >= split ? j - split : j;
+                        from = reverse ? n - 1 - j : j;
+                        dest->x[k][m] = src->x[i][from];
+                        dest->y[k][m] = src->y[i][from];
+                        dest->points[k] = m + 1;
+                }
+                dest->len += split < n ? 2 : 1;
+        }
+        if (dest->len > 1 && test_random(3) == 0) {
+                Proto swap = *dest;
+
+                i = test_random(dest->len);
+                j = test_random(dest->len);
+                dest->points[i] = swap.points[j];
+                dest->points[j] = swap.points[i];
+                memcpy(dest->x[i], swap.x[j], sizeof (swap.x[j]));
+                memcpy(dest->y[i], swap.y[j], sizeof (swap.y[j]));
+                memcpy(dest->x[j], swap.x[i], sizeof (swap.x[i]));
+                memcpy(dest->y[j], swap.y[i], sizeof (swap.y[i]));
+        }
+}
+
+int main(int argc, char **argv)
+{
+        MapBuffers buffers;
+        int trials, t, mismatches = 0, valid = 0, changed = 0;
+
+        trials = argc > 1 ? atoi(argv[1]) : 20000;
+        test_init();
+        map_buffers_init(&buffers);
+        for (t = 0; t < trials; t++) {
+                Proto proto, split;
+                Sample larger, smaller;
+                Transform tfm, ref_tfm, stale_tfm;
+                Vec2 offset;
+                float dist, ref_dist, stale_dist, penalty = 0.f,
+                      ref_penalty = 0.f, stale_penalty = 0.f;
+
+                /* Every fourth pair is of two different characters. When
+                   candidates may be measured on the worker pool, the
+                   characters have enough strokes for that. */
+                ignore_stroke_dir = t % 2;
+                buffers.parallel = t / 4 % 2;
+                proto_new(&proto, buffers.parallel ? 16 : 8);
+                if (t % 4)
+                        proto_split(&split, &proto);
+                else
+                        proto_new(&split, buffers.parallel ? 24 : 12);
+                proto_sample(&smaller, &proto, 4);
+                proto_sample(&larger, &split, 4);
+                if (larger.len < smaller.len) {
+                        Sample swap = larger;
+
+                        larger = smaller;
+                        smaller = swap;
+                }
+                process_sample(&larger);
+                process_sample(&smaller);
+                center_samples(&offset, &smaller, &larger);
+
+                dist = greedy_map(&larger, &smaller, &tfm, &offset, &penalty,
+                                  &buffers);
+                ref_dist = reference_map(&larger, &smaller, &ref_tfm,
+                                         &offset, &ref_penalty, FALSE);
+                stale_dist = reference_map(&larger, &smaller, &stale_tfm,
+                                           &offset, &stale_penalty, TRUE);
+                if (!same_mapping(&tfm, dist, penalty, &ref_tfm, ref_dist,
+                                  ref_penalty, larger.len) &&
+                    mismatches++ < 5)
+                        g_print("trial %d: %d onto %d strokes, %s %g, "
+                                "reference %s %g\n", t, larger.len,
+                                smaller.len, tfm.valid ? "valid" : "invalid",
+                                dist, ref_tfm.valid ? "valid" : "invalid",
+                                ref_dist);
+                valid += tfm.valid;
+                changed += !same_mapping(&ref_tfm, ref_dist, ref_penalty,
+                                         &stale_tfm, stale_dist,
+                                         stale_penalty, larger.len);
+                clear_sample(&larger);
+                clear_sample(&smaller);
+        }
+        map_buffers_free(&buffers);
+        g_print("%d mismatches in %d mappings, %d valid, %d glue failures\n"
+                "%d mappings differ with failed strokes left tagged\n",
+                mismatches, trials, valid, glue_failures / 2, changed);
+        return mismatches > 0;
+}
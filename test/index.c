@@ -0,0 +1,99 @@
+/*
+
+cellwriter -- a character recognition input method
+Copyright (C) 2007 Michael Levin <risujin@risujin.org>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+/* Test of the sample index on a profile that starts with many copies of one
+   sample. Leaves may only be left over-full if all of their samples are
+   copies, and every other sample must be found as its own nearest sample.
+   Usage: index [copies] [samples] */
+
+#include "recognize.c"
+#include "recognizer.h"
+
+static int same_descriptor(int a, int b)
+{
+        return !memcmp(sample_at(a)->descriptor, sample_at(b)->descriptor,
+                       DESCRIPTOR_LEN);
+}
+
+int main(int argc, char **argv)
+{
+        Proto proto;
+        Sample sample;
+        int i, j, copies, samples, leaves = 0, largest = 0, full = 0,
+            missed = 0;
+
+        copies = argc > 1 ? atoi(argv[1]) : 500;
+        samples = argc > 2 ? atoi(argv[2]) : 2000;
+        test_init();
+        samples_max = 1;
+
+        /* The copies fill the first leaf before anything else arrives */
+        proto_new(&proto, 4);
+        proto_sample(&sample, &proto, 4);
+        for (i = 0; i < copies; i++) {
+                sample.ch = 0x4E00 + i;
+                train_sample(&sample, TRUE);
+        }
+        clear_sample(&sample);
+        for (i = 0; i < samples; i++) {
+                proto_new(&proto, 4);
+                proto_sample(&sample, &proto, 4);
+                sample.ch = 0x4E00 + copies + i;
+                train_sample(&sample, TRUE);
+                clear_sample(&sample);
+        }
+
+        /* Over-full leaves must hold nothing but copies */
+        for (i = 0; i < (int)index_nodes->len; i++) {
+                GArray *slots = g_array_index(index_nodes, IndexNode, i).slots;
+
+                if (!slots)
+                        continue;
+                leaves++;
+                if ((int)slots->len > largest)
+                        largest = slots->len;
+                if (slots->len <= INDEX_LEAF_MAX)
+                        continue;
+                for (j = 1; j < (int)slots->len; j++)
+                        if (!same_descriptor(g_array_index(slots, int, 0),
+                                             g_array_index(slots, int, j)))
+                                break;
+                if (j < (int)slots->len && full++ < 5)
+                        g_print("leaf %d: %d samples are not all copies\n",
+                                i, slots->len);
+        }
+
+        /* Every sample is its own nearest sample */
+        ignore_stroke_num = TRUE;
+        for (i = 0; i < store.slots; i++) {
+                int slot;
+
+                if (!store.ch[i] ||
+                    sample_index_query(sample_at(i), 1, store.slots,
+                                       &slot) != 1 ||
+                    !same_descriptor(i, slot))
+                        missed++;
+        }
+        g_print("%d samples in %d leaves, largest %d, %d not split, "
+                "%d not found\n", sample_index_size(), leaves, largest, full,
+                missed);
+        return full || missed;
+}
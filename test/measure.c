@@ -0,0 +1,285 @@
+
+/*
+
+cellwriter -- a character recognition input method
+Copyright (C) 2007 Michael Levin <risujin@risujin.org>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+/* Benchmark of the specialized stroke measure tables against the generic
+   tables they are made from. The integer angle table is also timed against
+   the float table it replaces, the fused distance and angle pass against
+   the two tables filled out one after the other, and the fused measure
+   taken in lanes against the fused pass on one stroke pair at a time. The
+   generic tables are reached through volatile variables, so the compiler
+   cannot specialize them as well. By default strokes are measured at a
+   typical rough matching length and at a long fine matching length.
+   Usage: measure [points ...] */
+
+#include "averages.c"
+#include "recognizer.h"
+
+/* Strokes measured against each other */
+#define STROKES 48
+
+/* Times every pair of strokes is measured in a round */
+#define PASSES 10
+
+/* Rounds timed for each measure, the fastest one is kept */
+#define ROUNDS 5
+
+/* Stroke lengths measured when none are given. Most rough measures are of
+   strokes sampled to the shortest length measure_partial() allows. */
+#define ROUGH_POINTS 4
+#define FINE_POINTS 48
+
+typedef float (*Measure)(Stroke *a, Stroke *b, Vec2 *offset, int points,
+                         int *cells);
+
+static volatile MeasureFunc generic_func;
+static volatile int generic_elasticity;
+
+static float diagonal(Stroke *a, Stroke *b, Vec2 *offset, int points,
+                      int *cells)
+{
+        return measure_diagonal(a, b, offset, points, MEASURE_ABANDONED,
+                                cells);
+}
+
+static float table_fine(Stroke *a, Stroke *b, Vec2 *offset, int points,
+                        int *cells)
+{
+        return measure_table_fine(a, b, offset, points, MEASURE_ABANDONED,
+                                  cells);
+}
+
+static float generic_table(Stroke *a, Stroke *b, Vec2 *offset, int points,
+                           int *cells)
+{
+        return measure_table(a, b, generic_func, offset, points,
+                             generic_elasticity, MEASURE_ABANDONED, cells);
+}
+
+#if ANGLE_SIZE < 4
+static float angles_fine(Stroke *a, Stroke *b, Vec2 *offset, int points,
+                         int *cells)
+{
+        return measure_angles_fine(a, b, points - 1, cells);
+}
+
+static float generic_angles(Stroke *a, Stroke *b, Vec2 *offset, int points,
+                            int *cells)
+{
+        return measure_angles(a, b, points - 1, generic_elasticity, cells);
+}
+
+static float both(Stroke *a, Stroke *b, Vec2 *offset, int points, int *cells)
+{
+        float dist, angle;
+
+        measure_both(a, b, offset, points, FINE_ELASTICITY, MEASURE_ABANDONED,
+                     TRUE, &dist, &angle, cells);
+        return dist + angle;
+}
+
+static float rows(Stroke *a, Stroke *b, Vec2 *offset, int points, int *cells)
+{
+        return table_fine(a, b, offset, points, cells) +
+               angles_fine(a, b, offset, points, cells);
+}
+
+static float float_angles(Stroke *a, Stroke *b, Vec2 *offset, int points,
+                          int *cells)
+{
+        return measure_table(a, b, generic_func, offset, points - 1,
+                             generic_elasticity, MEASURE_ABANDONED, cells);
+}
+#endif
+
+/* The specializations that measure_strokes() dispatches to */
+static const struct {
+        const char *name;
+        Measure special, generic;
+        MeasureFunc func;
+        int elasticity;
+} kinds[] = {
+        { "distance, no elasticity", diagonal, generic_table,
+          (MeasureFunc)measure_distance, 0 },
+        { "distance, fine elasticity", table_fine, generic_table,
+          (MeasureFunc)measure_distance, FINE_ELASTICITY },
+#if ANGLE_SIZE < 4
+        { "angle, fine elasticity", angles_fine, generic_angles,
+          (MeasureFunc)measure_angle, FINE_ELASTICITY },
+        { "angle, integer table", generic_angles, float_angles,
+          (MeasureFunc)measure_angle, FINE_ELASTICITY },
+        { "distance and angle, fused", both, rows,
+          (MeasureFunc)measure_distance, FINE_ELASTICITY },
+#endif
+};
+
+static double time_measure(Measure measure, Stroke **strokes, Vec2 *offset,
+                           int points, float *psum)
+/* Fastest time of a measure in nanoseconds */
+{
+        double best = G_MAXDOUBLE;
+        int round;
+
+        for (round = 0; round < ROUNDS; round++) {
+                double t;
+                float sum = 0.f;
+                int i, j, pass, cells = 0;
+
+                t = test_time();
+                for (pass = 0; pass < PASSES; pass++)
+                        for (i = 0; i < STROKES; i++)
+                                for (j = 0; j < STROKES; j++)
+                                        sum += measure(strokes[i], strokes[j],
+                                                       offset, points,
+                                                       &cells);
+                t = test_time() - t;
+                if (t < best)
+                        best = t;
+                *psum = sum;
+        }
+        return best * 1e9 / (PASSES * STROKES * STROKES);
+}
+
+#if ANGLE_SIZE < 4
+static double time_lanes(Stroke **strokes, Vec2 *offset, int points,
+                         float *psum)
+/* Fastest time in nanoseconds of a fused measure taken in lanes, with
+   every stroke measured against eight strokes at a time. Putting the points
+   into the lanes is timed too. */
+{
+        MeasureLanes *lanes;
+        double best = G_MAXDOUBLE;
+        float limits[AVERAGE_LANES], dists[AVERAGE_LANES],
+              angles[AVERAGE_LANES];
+        int l, round;
+
+        lanes = lanes_get();
+        for (l = 0; l < AVERAGE_LANES; l++)
+                limits[l] = MEASURE_ABANDONED;
+        for (round = 0; round < ROUNDS; round++) {
+                double t;
+                float sum = 0.f;
+                int i, j, pass, live[AVERAGE_LANES];
+
+                t = test_time();
+                for (pass = 0; pass < PASSES; pass++)
+                        for (i = 0; i < STROKES; i++)
+                                for (j = 0; j < STROKES; j += AVERAGE_LANES) {
+                                        for (l = 0; l < AVERAGE_LANES; l++) {
+                                                lanes_set(lanes, l, strokes[i],
+                                                          strokes[j + l],
+                                                          offset, points);
+                                                live[l] = TRUE;
+                                        }
+                                        measure_lanes(lanes, AVERAGE_LANES,
+                                                      points, limits, live,
+                                                      dists, angles);
+                                        for (l = 0; l < AVERAGE_LANES; l++)
+                                                sum += dists[l] + angles[l];
+                                }
+                t = test_time() - t;
+                if (t < best)
+                        best = t;
+                *psum = sum;
+        }
+        return best * 1e9 / (PASSES * STROKES * STROKES);
+}
+#endif
+
+static int measure_points(int points)
+/* Time every kind of measure on strokes of POINTS points, returns the number
+   of specializations that did not match their generic table */
+{
+        Stroke *strokes[STROKES];
+        Vec2 offset;
+        int i, mismatches = 0;
+
+        /* Strokes of made up characters, sampled to the same length */
+        for (i = 0; i < STROKES; ) {
+                Proto proto;
+                Sample sample;
+
+                proto_new(&proto, 1);
+                proto_sample(&sample, &proto, 4);
+                if (sample.strokes[0]->spread >= DOT_SPREAD)
+                        strokes[i++] = sample_stroke(NULL, sample.strokes[0],
+                                                     points, points);
+                clear_sample(&sample);
+        }
+        vec2_set(&offset, 3.f, -2.f);
+
+        g_print("%d points, ns per measure:\n", points);
+        for (i = 0; i < sizeof (kinds) / sizeof (*kinds); i++) {
+                double special, generic;
+                float special_sum, generic_sum;
+
+                generic_func = kinds[i].func;
+                generic_elasticity = kinds[i].elasticity;
+                special = time_measure(kinds[i].special, strokes, &offset,
+                                       points, &special_sum);
+                generic = time_measure(kinds[i].generic, strokes, &offset,
+                                       points, &generic_sum);
+                g_print("%-26s %8.1f specialized %8.1f generic %5.2fx%s\n",
+                        kinds[i].name, special, generic, generic / special,
+                        special_sum == generic_sum ? "" : " MISMATCH");
+                mismatches += special_sum != generic_sum;
+        }
+#if ANGLE_SIZE < 4
+        {
+                double special, generic;
+                float special_sum, generic_sum;
+
+                special = time_lanes(strokes, &offset, points, &special_sum);
+                generic = time_measure(both, strokes, &offset, points,
+                                       &generic_sum);
+                g_print("%-26s %8.1f specialized %8.1f generic %5.2fx%s\n",
+                        "distance and angle, lanes", special, generic,
+                        generic / special,
+                        special_sum == generic_sum ? "" : " MISMATCH");
+                mismatches += special_sum != generic_sum;
+        }
+#endif
+        for (i = 0; i < STROKES; i++)
+                stroke_free(strokes[i]);
+        return mismatches;
+}
+
+int main(int argc, char **argv)
+{
+        int i, points, mismatches = 0;
+
+        for (i = 1; i < argc; i++) {
+                points = atoi(argv[i]);
+                if (points < 2 || points >= POINTS_MAX) {
+                        g_print("Points must be between 2 and %d\n",
+                                POINTS_MAX - 1);
+                        return 1;
+                }
+        }
+        test_init();
+        if (argc < 2) {
+                mismatches += measure_points(ROUGH_POINTS);
+                mismatches += measure_points(FINE_POINTS);
+        }
+        for (i = 1; i < argc; i++)
+                mismatches += measure_points(atoi(argv[i]));
+        return mismatches > 0;
+}
@@ -0,0 +1,161 @@
+
+/*
+
+cellwriter -- a character recognition input method
+Copyright (C) 2007 Michael Levin <risujin@risujin.org>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include "config.h"
+#include <math.h>
+#include <sys/time.h>
+#include <gtk/gtk.h>
+#include "common.h"
+#include "recognize.h"
+#include "recognizer.h"
+
+void recognize_init(void);
+
+/*
+        Rest of CellWriter
+*/
+
+UnicodeBlock unicode_blocks[] = {
+        { TRUE, 0x0000, 0x007F, "Basic Latin" },
+        { TRUE, 0x0080, 0xFFFF, "Everything else" },
+        { FALSE, 0, 0, NULL },
+};
+
+int profile_line, profile_read_only = TRUE, log_level = 0;
+
+const char *profile_read(void)
+{
+        return "";
+}
+
+int profile_write(const char *str)
+{
+        return 0;
+}
+
+int profile_sync_int(int *var)
+{
+        return 0;
+}
+
+int profile_sync_short(short *var)
+{
+        return 0;
+}
+
+void log_print(const char *format, ...)
+{
+}
+
+char *va(const char *format, ...)
+{
+        return "";
+}
+
+const char *cell_widget_word(void)
+{
+        return "";
+}
+
+/*
+        Made up samples
+*/
+
+int test_random(int n)
+/* Pseudo-random number from 0 to N - 1 */
+{
+        static unsigned int seed = 12345;
+
+        seed = seed * 1103515245u + 12345u;
+        return (seed >> 8) % n;
+}
+
+void proto_new(Proto *proto, int strokes_max)
+/* Make up a character of wandering strokes and dots */
+{
+        int i, j;
+
+        proto->len = 1 + test_random(strokes_max);
+        for (i = 0; i < proto->len; i++) {
+                double x, y, angle, step;
+
+                x = test_random(160) - 80;
+                y = test_random(160) - 80;
+                angle = test_random(628) / 100.;
+                step = 6 + test_random(6);
+                proto->points[i] = test_random(5) ? 5 + test_random(30) : 1;
+                for (j = 0; j < proto->points[i]; j++) {
+                        proto->x[i][j] = x;
+                        proto->y[i][j] = y;
+                        angle += (test_random(80) - 40) / 100.;
+                        x += cos(angle) * step;
+                        y += sin(angle) * step;
+                        x = x > 110 ? 110 : x < -110 ? -110 : x;
+                        y = y > 110 ? 110 : y < -110 ? -110 : y;
+                }
+        }
+}
+
+void proto_sample(Sample *sample, const Proto *proto, int jitter)
+/* Draw a sample of a made up character, shifted and shaken by up to JITTER
+   points */
+{
+        int i, j, dx, dy;
+
+        memset(sample, 0, sizeof (*sample));
+        dx = test_random(2 * jitter + 1) - jitter;
+        dy = test_random(2 * jitter + 1) - jitter;
+        for (i = 0; i < proto->len; i++) {
+                Stroke *stroke = NULL;
+
+                for (j = 0; j < proto->points[i]; j++)
+                        draw_stroke(&stroke, proto->x[i][j] + dx +
+                                    test_random(2 * jitter + 1) - jitter,
+                                    proto->y[i][j] + dy +
+                                    test_random(2 * jitter + 1) - jitter);
+                smooth_stroke(stroke);
+                simplify_stroke(stroke);
+                process_stroke(stroke);
+                sample->strokes[sample->len++] = stroke;
+        }
+}
+
+/*
+        Recognizer setup
+*/
+
+void test_init(void)
+/* Set up the recognizer the way CellWriter does */
+{
+        if (!g_thread_supported())
+                g_thread_init(NULL);
+        recognize_init();
+}
+
+double test_time(void)
+/* Wall clock time in seconds */
+{
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+}
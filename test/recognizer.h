@@ -0,0 +1,52 @@
+
+/*
+
+cellwriter -- a character recognition input method
+Copyright (C) 2007 Michael Levin <risujin@risujin.org>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+/* Support for the recognizer tests and benchmarks. They are linked with the
+   recognition sources, this provides the rest of CellWriter that those
+   need and makes up samples to train and recognize. The CellWriter headers
+   have no include guards, so they are included before this one, either
+   directly or through a source file a test includes to reach its static
+   functions. */
+
+/* Largest number of strokes in a made up character */
+#define PROTO_STROKES_MAX 24
+
+/* Largest number of points in a made up stroke */
+#define PROTO_POINTS_MAX 40
+
+/* A made up character that samples are drawn from */
+typedef struct {
+        int len, points[PROTO_STROKES_MAX],
+            x[PROTO_STROKES_MAX][PROTO_POINTS_MAX],
+            y[PROTO_STROKES_MAX][PROTO_POINTS_MAX];
+} Proto;
+
+/* Pseudo-random numbers that are the same on every run */
+int test_random(int n);
+
+/* Made up samples */
+void proto_new(Proto *proto, int strokes_max);
+void proto_sample(Sample *sample, const Proto *proto, int jitter);
+
+/* Recognizer setup */
+void test_init(void);
+double test_time(void);
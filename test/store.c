@@ -0,0 +1,79 @@
+
+/*
+
+cellwriter -- a character recognition input method
+Copyright (C) 2007 Michael Levin <risujin@risujin.org>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+/* Benchmark of full passes over the sample store. Usage: store [samples] */
+
+#include "config.h"
+#include <gtk/gtk.h>
+#include "common.h"
+#include "recognize.h"
+#include "recognizer.h"
+
+/* Passes timed for each kind */
+#define PASSES 2000
+
+/* Samples trained for each character */
+#define CHAR_SAMPLES 5
+
+int main(int argc, char **argv)
+{
+        Proto proto;
+        double t;
+        int i, j, samples, sum;
+
+        samples = argc > 1 ? atoi(argv[1]) : 6000;
+        test_init();
+        samples_max = CHAR_SAMPLES;
+        for (i = 0; i < samples / CHAR_SAMPLES; i++) {
+                proto_new(&proto, 4);
+                for (j = 0; j < CHAR_SAMPLES; j++) {
+                        Sample sample;
+
+                        proto_sample(&sample, &proto, 6);
+                        sample.ch = 0x4E00 + i;
+                        train_sample(&sample, TRUE);
+                        clear_sample(&sample);
+                }
+        }
+        update_enabled_samples();
+        g_print("%d samples of %d characters\n", i * CHAR_SAMPLES, i);
+
+        /* Enabling samples by Unicode block */
+        t = test_time();
+        for (j = 0; j < PASSES / 10; j++)
+                update_enabled_samples();
+        g_print("update_enabled_samples(): %.2f us\n",
+                (test_time() - t) * 1e6 / (PASSES / 10));
+
+        /* Walking the store with the sample iterator */
+        t = test_time();
+        for (j = 0, sum = 0; j < PASSES; j++) {
+                Sample *sample;
+
+                sampleiter_reset();
+                while ((sample = sampleiter_next()))
+                        sum += sample->len;
+        }
+        g_print("sampleiter_next() pass: %.2f us (%d)\n",
+                (test_time() - t) * 1e6 / PASSES, sum);
+        return 0;
+}